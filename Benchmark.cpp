@@ -0,0 +1,217 @@
+#include <WS2tcpip.h>
+
+#include <benchmark/benchmark.h>
+
+#include <atomic>
+#include <condition_variable>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "FileCache.h"
+#include "Job.h"
+#include "PathResolver.h"
+#include "ThreadPoolVars.h"
+
+/*
+ * Microbenchmarks for the pieces every server request goes through: handing a job from the
+ * queue to a worker, reading, caching and hashing the file, resolving its path and printing to the console.
+ * The end-to-end numbers for whole servers come from LoadDriver.cpp instead.
+ */
+
+static const std::string FIXTURE_DIR = "bench_micro";
+
+// Write a file of the given size filled with printable text. The seed is fixed so every run reads the same bytes.
+static std::string writeFixture(const std::string& name, size_t size) {
+	CreateDirectoryA(FIXTURE_DIR.c_str(), nullptr);
+	std::mt19937 rng(54000);
+	std::uniform_int_distribution<int> printable('a', 'z');
+	std::string contents(size, ' ');
+	for (size_t i = 0; i < size; i++) {
+		contents[i] = (i % 80 == 79) ? '\n' : static_cast<char>(printable(rng));
+	}
+	std::ofstream f(FIXTURE_DIR + "\\" + name, std::ios::binary);
+	f << contents;
+	return name;
+}
+
+// A std::streambuf that throws everything away, so the logging benchmark measures locking and
+// formatting rather than how fast the console can scroll.
+class NullBuffer : public std::streambuf {
+protected:
+	int overflow(int c) override { return c; }
+	std::streamsize xsputn(const char*, std::streamsize n) override { return n; }
+};
+
+// Pushing to and popping from the job queue the way ThreadPoolServerImproved does,
+// with state.range(0) workers waiting on the condition variable.
+static void BM_QueueHandoff(benchmark::State& state) {
+	std::mutex socketMu;
+	JobQueue jobQueue;
+	unsigned long long jobsQueued = 0;
+	std::condition_variable socketCV;
+	std::atomic<int64_t> handled(0);
+	bool done = false;
+
+	// The server puts the same jobs back on the queue between slices, so cycle through a fixed set of them rather
+	// than allocating one per push. Every tenth is a 4MB transfer, the rest are small files.
+	const int JOB_COUNT = 1024;
+	std::vector<std::shared_ptr<Job>> jobs;
+	// How many times each job is on the queue, guarded by socketMu
+	std::vector<int> queuedCopies(JOB_COUNT, 0);
+	for (int i = 0; i < JOB_COUNT; i++) {
+		auto job = std::make_shared<Job>();
+		job->userNumber = i;
+		job->fileRemaining = (i % 10 == 0) ? 4 * 1024 * 1024 : 100;
+		jobs.push_back(job);
+	}
+
+	std::vector<std::thread> workers;
+	for (int i = 0; i < state.range(0); i++) {
+		workers.emplace_back([&] {
+			while (true) {
+				std::unique_lock<std::mutex> socketLock(socketMu);
+				socketCV.wait(socketLock, [&] { return done || !jobQueue.empty(); });
+				if (jobQueue.empty()) {
+					return;
+				}
+				queuedCopies[jobQueue.top()->userNumber]--;
+				jobQueue.pop();
+				socketLock.unlock();
+				socketCV.notify_one();
+				handled++;
+			}
+		});
+	}
+
+	int64_t pushed = 0;
+	for (auto _ : state) {
+		const std::shared_ptr<Job>& job = jobs[pushed % JOB_COUNT];
+		{
+			std::lock_guard<std::mutex> socketLock(socketMu);
+			// Changing the key of a job that's still on the queue would break the heap, so a job the workers
+			// haven't caught up with goes on again as it is
+			if (queuedCopies[job->userNumber]++ == 0) {
+				job->readyAt = GetTickCount64();
+				job->prioritize();
+				job->sequence = jobsQueued++;
+			}
+			jobQueue.push(job);
+		}
+		socketCV.notify_one();
+		pushed++;
+	}
+	// Only count the hand-off as finished once a worker has actually picked everything up
+	while (handled.load() < pushed) {
+		std::this_thread::yield();
+	}
+
+	{
+		std::lock_guard<std::mutex> socketLock(socketMu);
+		done = true;
+	}
+	socketCV.notify_all();
+	for (auto& worker : workers) {
+		worker.join();
+	}
+	state.SetItemsProcessed(pushed);
+}
+BENCHMARK(BM_QueueHandoff)->Arg(1)->Arg(5)->Arg(20)->UseRealTime();
+
+// Reading a whole file the way handleConnection does, through an ifstream and an ostringstream.
+static void BM_FileReadStringstream(benchmark::State& state) {
+	std::string path = FIXTURE_DIR + "\\" + writeFixture("read_" + std::to_string(state.range(0)) + ".txt", state.range(0));
+	for (auto _ : state) {
+		std::ifstream f(path);
+		std::ostringstream ss_buf;
+		ss_buf << f.rdbuf();
+		std::string outText = ss_buf.str();
+		benchmark::DoNotOptimize(outText.data());
+	}
+	state.SetBytesProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_FileReadStringstream)->Arg(100)->Arg(64 << 10)->Arg(4 << 20);
+
+// Looking up a file that's already in the FileCache, which every repeat digest request does: a stat and a map lookup
+static void BM_FileCacheHit(benchmark::State& state) {
+	std::string path = FIXTURE_DIR + "\\" + writeFixture("cache.txt", 4 << 10);
+	FileCache cache;
+	FileCache::Entry entry;
+	cache.lookup(path, entry);
+	for (auto _ : state) {
+		benchmark::DoNotOptimize(cache.lookup(path, entry));
+	}
+}
+BENCHMARK(BM_FileCacheHit);
+
+// Hashing a file's bytes, which the FileCache does whenever a file is new or has changed
+static void BM_Sha256(benchmark::State& state) {
+	std::string data(static_cast<size_t>(state.range(0)), 'x');
+	for (auto _ : state) {
+		Sha256 hash;
+		hash.update(data.data(), data.size());
+		std::string digest = hash.hexDigest();
+		benchmark::DoNotOptimize(digest.data());
+	}
+	state.SetBytesProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_Sha256)->Arg(4 << 10)->Arg(64 << 10)->Arg(4 << 20);
+
+static void BM_PathResolveFound(benchmark::State& state) {
+	std::string name = writeFixture("resolve.txt", 100);
+	PathResolver resolver(FIXTURE_DIR);
+	std::string resolved;
+	PathResolver::Pin pin;
+	for (auto _ : state) {
+		benchmark::DoNotOptimize(resolver.resolve(name, resolved, pin));
+	}
+}
+BENCHMARK(BM_PathResolveFound);
+
+// After the first miss, every lookup should be answered by the negative cache
+static void BM_PathResolveMissing(benchmark::State& state) {
+	PathResolver resolver(FIXTURE_DIR);
+	std::string resolved;
+	PathResolver::Pin pin;
+	for (auto _ : state) {
+		benchmark::DoNotOptimize(resolver.resolve("does_not_exist.txt", resolved, pin));
+	}
+}
+BENCHMARK(BM_PathResolveMissing);
+
+static void BM_PathResolveTraversal(benchmark::State& state) {
+	PathResolver resolver(FIXTURE_DIR);
+	std::string resolved;
+	PathResolver::Pin pin;
+	for (auto _ : state) {
+		benchmark::DoNotOptimize(resolver.resolve("..\\..\\Windows\\win.ini", resolved, pin));
+	}
+}
+BENCHMARK(BM_PathResolveTraversal);
+
+// One of the log lines handleConnection prints, with every thread fighting over the cout mutex
+static void BM_LoggingPrint(benchmark::State& state) {
+	static ThreadPoolVars threadVars;
+	static NullBuffer nullBuffer;
+	static std::streambuf* coutBuffer = nullptr;
+	if (state.thread_index() == 0) {
+		coutBuffer = std::cout.rdbuf(&nullBuffer);
+	}
+	for (auto _ : state) {
+		std::string coutStr = "User number " + std::to_string(state.iterations()) + " on thread " +
+			std::to_string(state.thread_index()) + " is sending message.";
+		threadVars.print(coutStr);
+	}
+	if (state.thread_index() == 0) {
+		std::cout.rdbuf(coutBuffer);
+	}
+}
+BENCHMARK(BM_LoggingPrint)->Threads(1)->Threads(5)->Threads(20)->UseRealTime();
+
+BENCHMARK_MAIN();
@@ -1,20 +1,36 @@
 #include <WS2tcpip.h>
 
+#include <chrono>
 #include <exception>
+#include <future>
 #include <iostream>
 #include <mutex>
+#include <sstream>
 #include <string>
 #include <thread>
 #include <vector>
 
+#include "FileClient.h"
+#include "TlsChannel.h"
+
 #pragma comment (lib, "ws2_32.lib")
 
 // used to lock and unlock std::cout for pretty-printing to console/file
 std::mutex mu;
 
+// Only set when the client was started with --tls. The server's certificate has to be issued to TLS_HOST.
+static std::unique_ptr<TlsCredentials> tlsCredentials;
+static const std::string TLS_HOST = "localhost";
+
 static const std::string EXPECTED_FILE_CONTENTS = "Hello, this is some random text that I've generated for the purpose of a multithreaded server test.";
 
-void createConnection(int id) {
+// Digest of the file from the last time the server sent it in full, "-" until then. Once a thread knows it,
+// the others only ask the server whether the file has changed instead of fetching it again. Guarded by mu.
+static std::string knownDigest = "-";
+
+// One request on its own thread and connection. With plain set it speaks the original protocol, a bare filename
+// answered with the file and the connection closing, which is all ThreadedServer and ThreadPoolServer understand.
+void createConnection(int id, bool plain) {
 	const std::string IP_ADDRESS = "127.0.0.1";
 	const int PORT = 54000;
 	const std::string FILENAME = "RandomText.txt";
@@ -23,7 +39,6 @@ void createConnection(int id) {
 	SOCKET sock = socket(AF_INET, SOCK_STREAM, 0);
 	if (sock == INVALID_SOCKET)
 	{
-		WSACleanup();
 		throw std::runtime_error("Can't create socket");
 	}
 
@@ -37,10 +52,15 @@ void createConnection(int id) {
 	if (connResult == SOCKET_ERROR)
 	{
 		closesocket(sock);
-		WSACleanup();
 		throw std::runtime_error("Can't connect to server");
 	}
 	
+	TlsChannel channel(sock);
+	if (tlsCredentials && !channel.connect(*tlsCredentials, TLS_HOST)) {
+		closesocket(sock);
+		throw std::runtime_error("TLS handshake failed");
+	}
+
 	mu.lock();
 	std::cout << "Thread with id: " << id << " connected to server!" << std::endl;
 	mu.unlock();
@@ -50,7 +70,7 @@ void createConnection(int id) {
 	ZeroMemory(buf, BUFSIZE);
 
 	// Receive message from server asking to provide a filename
-	int byteCount = recv(sock, buf, BUFSIZE, 0);
+	int byteCount = channel.recv(buf, BUFSIZE);
 	if (byteCount == SOCKET_ERROR) {
 		throw std::runtime_error("Error receiving message");
 	}
@@ -59,14 +79,72 @@ void createConnection(int id) {
 		throw std::runtime_error("Server disconnected");
 	}
 
-	// send the name of the known file
-	strcpy_s(buf, FILENAME.c_str());
-	byteCount = strlen(FILENAME.c_str());
-	send(sock, buf, byteCount, 0);
+	if (plain) {
+		channel.send(FILENAME);
+		std::string fileContents;
+		while ((byteCount = channel.recv(buf, BUFSIZE)) > 0) {
+			fileContents.append(buf, byteCount);
+		}
+		closesocket(sock);
+		if (byteCount == SOCKET_ERROR) {
+			throw std::runtime_error("Error receiving the file");
+		}
+		mu.lock();
+		std::cout << "Thread with id: " << id << " received: " << fileContents << std::endl;
+		mu.unlock();
+		if (fileContents != EXPECTED_FILE_CONTENTS) {
+			throw std::runtime_error("The contents of the file are unexpected!");
+		}
+		return;
+	}
 
-	// receive the message
-	byteCount = recv(sock, buf, BUFSIZE, 0);
-	std::string fileContents = std::string(buf);
+	// ask for the known file, but only if it's different from the version we already have
+	mu.lock();
+	std::string digest = knownDigest;
+	mu.unlock();
+	channel.send("GET " + digest + " " + FILENAME + "\n");
+
+	// receive the response, the first line says what follows
+	std::string response;
+	size_t lineEnd;
+	while ((lineEnd = response.find('\n')) == std::string::npos) {
+		byteCount = channel.recv(buf, BUFSIZE);
+		if (byteCount <= 0) {
+			closesocket(sock);
+			throw std::runtime_error("Server disconnected before responding");
+		}
+		response.append(buf, byteCount);
+	}
+	std::istringstream statusLine(response.substr(0, lineEnd));
+	std::string status;
+	std::string responseDigest;
+	size_t length = 0;
+	statusLine >> status >> responseDigest >> length;
+	std::string fileContents = response.substr(lineEnd + 1);
+
+	if (status == "SAME") {
+		closesocket(sock);
+		if (responseDigest != digest) {
+			throw std::runtime_error("The server confirmed a digest we didn't ask about!");
+		}
+		mu.lock();
+		std::cout << "Thread with id: " << id << " already has the latest file, digest " << responseDigest << std::endl;
+		mu.unlock();
+		return;
+	}
+	if (status != "OK") {
+		closesocket(sock);
+		throw std::runtime_error("The server doesn't have the file!");
+	}
+
+	while (fileContents.size() < length) {
+		byteCount = channel.recv(buf, BUFSIZE);
+		if (byteCount <= 0) {
+			break;
+		}
+		fileContents.append(buf, byteCount);
+	}
+	closesocket(sock);
 	mu.lock();
 	std::cout << "Thread with id: " << id << " received: " << fileContents << std::endl;
 	mu.unlock();
@@ -74,9 +152,72 @@ void createConnection(int id) {
 	if (fileContents != EXPECTED_FILE_CONTENTS) {
 		throw std::runtime_error("The contents of the file are unexpected!");
 	}
+	mu.lock();
+	knownDigest = responseDigest;
+	mu.unlock();
 }
 
-void main() {
+static std::string describe(const FetchResult& result) {
+	switch (result.status) {
+	case FetchResult::Status::Ok: return "OK, digest " + result.digest;
+	case FetchResult::Status::Mapped: return "mapped, digest " + result.digest;
+	case FetchResult::Status::NotModified: return "unchanged, digest " + result.digest;
+	case FetchResult::Status::Missing: return "the server doesn't have the file";
+	case FetchResult::Status::TimedOut: return "timed out: " + result.error;
+	default: return "failed: " + result.error;
+	}
+}
+
+// Fetch the known file numRequests times at once from a single FileClient. It spreads them over a few pooled
+// connections from one event loop thread, instead of a thread and a fresh connection for every request.
+// With local set, it connects over the server's Unix domain socket and has the file mapped instead of sent.
+// Returns the number of requests that didn't get the expected file back.
+static int fetchAsync(int numRequests, bool local) {
+	const std::string FILENAME = "RandomText.txt";
+
+	// Generous, since a connection's requests are answered one after another, and the server in its default build
+	// pauses before each one. The last of 100 requests over 4 connections waits for 24 others.
+	const std::chrono::milliseconds DEADLINE(30000);
+
+	FileClient::Options options;
+	if (local) {
+		options.unixSocketPath = "MultithreadServer.sock";
+	}
+	FileClient client(options);
+	std::vector<std::future<FetchResult>> results;
+	for (int i = 1; i <= numRequests; i++) {
+		results.push_back(local ? client.map(FILENAME, DEADLINE) : client.fetch(FILENAME, DEADLINE));
+	}
+
+	int failures = 0;
+	std::string digest;
+	for (int i = 0; i < numRequests; i++) {
+		FetchResult result = results[i].get();
+		std::string contents = result.status == FetchResult::Status::Mapped ?
+			std::string(result.mapped->data(), result.mapped->size()) : result.contents;
+		bool received = result.status == FetchResult::Status::Ok || result.status == FetchResult::Status::Mapped;
+		if (received && contents == EXPECTED_FILE_CONTENTS) {
+			digest = result.digest;
+			std::cout << "Request with id: " << i + 1 << " received (" << describe(result) << "): " << contents << std::endl;
+		}
+		else {
+			failures++;
+			std::cout << "Request with id: " << i + 1 << " " << describe(result) << std::endl;
+		}
+	}
+
+	// Now that we have the file, asking again with its digest shouldn't transfer it again
+	if (!digest.empty()) {
+		FetchResult result = client.fetch(FILENAME, DEADLINE, digest).get();
+		std::cout << "Fetching again with the digest we have: " << describe(result) << std::endl;
+		if (result.status != FetchResult::Status::NotModified) {
+			failures++;
+		}
+	}
+	return failures;
+}
+
+void main(int argc, char* argv[]) {
 	WSADATA wsData;
 	WORD ver = MAKEWORD(2, 2);
 	const int NUM_THREADS = 100;
@@ -87,11 +228,49 @@ void main() {
 		return;
 	}
 
+	bool tls = false;
+	bool local = false;
+	bool plain = false;
+	for (int i = 1; i < argc; i++) {
+		std::string arg = argv[i];
+		tls = tls || arg == "--tls";
+		local = local || arg == "--local";
+		plain = plain || arg == "--plain";
+	}
+
+	// FileClient only speaks the digest protocol over plain TCP or the Unix domain socket, so without
+	// --tls or --plain everything goes through it. --local uses the Unix domain socket and shared memory.
+	if (!tls && !plain) {
+		int failures = fetchAsync(NUM_THREADS, local);
+		std::cout << "Finished with " << failures << " failed requests." << std::endl;
+		WSACleanup();
+		return;
+	}
+
+	// Otherwise use a thread and a connection for each request, over TLS to a server that was started with --tls,
+	// and with the original protocol for --plain
+	if (tls) {
+		tlsCredentials = TlsCredentials::forClient();
+		if (!tlsCredentials) {
+			std::cerr << "can't create TLS credentials! quitting!" << std::endl;
+			return;
+		}
+	}
+
 	// create a vector of threads
 	std::vector<std::unique_ptr<std::thread>> threads;
 	for (int i = 1; i <= NUM_THREADS; i++) {
-		// spawn a new thread and create a new connection
-		threads.emplace_back(new std::thread(createConnection, i));
+		// spawn a new thread and create a new connection. An error only ends that thread's request, not the whole client.
+		threads.emplace_back(new std::thread([i, plain] {
+			try {
+				createConnection(i, plain);
+			}
+			catch (const std::exception& e) {
+				mu.lock();
+				std::cout << "Thread with id: " << i << " failed: " << e.what() << std::endl;
+				mu.unlock();
+			}
+		}));
 	}
 
 	// join all the threads after spawning
@@ -0,0 +1,139 @@
+#pragma once
+#include <WS2tcpip.h>
+
+#include <fstream>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "Sha256.h"
+
+/*
+ * Keeps the contents and SHA-256 digest of recently requested files in memory.
+ *
+ * Every lookup checks the file's size and last write time, which is much cheaper than reading it, and only
+ * reads and hashes the file again if either has changed. Files bigger than maxFileBytes only have their digest
+ * kept and are streamed from disk, and the least recently used files are dropped once the cache holds more
+ * than maxBytes of file data or more than MAX_ENTRIES files.
+ */
+class FileCache
+{
+public:
+	struct Entry {
+		// nullptr when the file is too big to keep in memory
+		std::shared_ptr<const std::string> contents;
+		std::string digest;
+		ULONGLONG size = 0;
+	};
+
+	static constexpr size_t MAX_ENTRIES = 4096;
+
+	FileCache(size_t maxBytes = 64 << 20, size_t maxFileBytes = 4 << 20)
+		: m_maxBytes(maxBytes), m_maxFileBytes(maxFileBytes), m_bytes(0) {}
+
+	// Returns false if the file can't be read
+	bool lookup(const std::string& path, Entry& entry) {
+		WIN32_FILE_ATTRIBUTE_DATA attributes;
+		if (!GetFileAttributesExA(path.c_str(), GetFileExInfoStandard, &attributes)) {
+			return false;
+		}
+		ULONGLONG size = (static_cast<ULONGLONG>(attributes.nFileSizeHigh) << 32) | attributes.nFileSizeLow;
+
+		{
+			std::lock_guard<std::mutex> lock(m_mu);
+			auto it = m_entries.find(path);
+			if (it != m_entries.end() && it->second.entry.size == size &&
+				CompareFileTime(&it->second.lastWrite, &attributes.ftLastWriteTime) == 0) {
+				m_lru.splice(m_lru.begin(), m_lru, it->second.lruPosition);
+				entry = it->second.entry;
+				return true;
+			}
+		}
+
+		// Read and hash outside of the lock so other files can still be served in the meantime
+		Entry fresh;
+		if (!readFile(path, size, fresh)) {
+			return false;
+		}
+		insert(path, fresh, attributes.ftLastWriteTime);
+		entry = fresh;
+		return true;
+	}
+
+private:
+	struct Cached {
+		Entry entry;
+		FILETIME lastWrite;
+		std::list<std::string>::iterator lruPosition;
+	};
+
+	bool readFile(const std::string& path, ULONGLONG size, Entry& entry) {
+		std::ifstream f(path, std::ios::binary);
+		if (!f.good()) {
+			return false;
+		}
+
+		Sha256 hash;
+		if (size <= m_maxFileBytes) {
+			std::shared_ptr<std::string> contents = std::make_shared<std::string>(static_cast<size_t>(size), '\0');
+			f.read(&(*contents)[0], contents->size());
+			contents->resize(static_cast<size_t>(f.gcount()));
+			hash.update(contents->data(), contents->size());
+			entry.size = contents->size();
+			entry.contents = contents;
+		}
+		else {
+			std::vector<char> buf(64 * 1024);
+			entry.size = 0;
+			while (f.read(buf.data(), buf.size()) || f.gcount() > 0) {
+				hash.update(buf.data(), static_cast<size_t>(f.gcount()));
+				entry.size += f.gcount();
+			}
+		}
+		entry.digest = hash.hexDigest();
+		return true;
+	}
+
+	void insert(const std::string& path, const Entry& entry, const FILETIME& lastWrite) {
+		std::lock_guard<std::mutex> lock(m_mu);
+		auto it = m_entries.find(path);
+		if (it != m_entries.end()) {
+			m_bytes -= cachedBytes(it->second.entry);
+			m_lru.erase(it->second.lruPosition);
+			m_entries.erase(it);
+		}
+
+		m_lru.push_front(path);
+		Cached cached;
+		cached.entry = entry;
+		cached.lastWrite = lastWrite;
+		cached.lruPosition = m_lru.begin();
+		m_entries.emplace(path, cached);
+		m_bytes += cachedBytes(entry);
+
+		// Drop the least recently used files, but never the one that was just added
+		while ((m_bytes > m_maxBytes || m_lru.size() > MAX_ENTRIES) && m_lru.size() > 1) {
+			auto oldest = m_entries.find(m_lru.back());
+			m_bytes -= cachedBytes(oldest->second.entry);
+			m_entries.erase(oldest);
+			m_lru.pop_back();
+		}
+	}
+
+	static size_t cachedBytes(const Entry& entry) {
+		return entry.contents ? entry.contents->size() : 0;
+	}
+
+	size_t m_maxBytes;
+	size_t m_maxFileBytes;
+
+	// mutex for everything below
+	std::mutex m_mu;
+	size_t m_bytes;
+	std::unordered_map<std::string, Cached> m_entries;
+	// most recently used at the front
+	std::list<std::string> m_lru;
+};
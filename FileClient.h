@@ -0,0 +1,555 @@
+#pragma once
+#include <WS2tcpip.h>
+#include <afunix.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <climits>
+#include <deque>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#pragma comment (lib, "ws2_32.lib")
+
+// A read-only view of a file the server shared with us through shared memory, unmapped when the last reference goes
+class MappedFile
+{
+public:
+	MappedFile(HANDLE section, const char* view, size_t size) : m_section(section), m_view(view), m_size(size) {}
+
+	~MappedFile() {
+		UnmapViewOfFile(m_view);
+		CloseHandle(m_section);
+	}
+
+	MappedFile(const MappedFile&) = delete;
+	MappedFile& operator=(const MappedFile&) = delete;
+
+	const char* data() const { return m_view; }
+	size_t size() const { return m_size; }
+
+private:
+	HANDLE m_section;
+	const char* m_view;
+	size_t m_size;
+};
+
+struct FetchResult {
+	enum class Status { Ok, Mapped, NotModified, Missing, TimedOut, Failed };
+
+	Status status = Status::Failed;
+	// The digest of the server's version of the file, for Ok and NotModified
+	std::string digest;
+	// Only filled in for Ok
+	std::string contents;
+	// Only filled in for Mapped
+	std::shared_ptr<const MappedFile> mapped;
+	// What went wrong, for Failed
+	std::string error;
+};
+
+/*
+ * Fetches files from ThreadPoolServerImproved using the digest protocol, from a single event loop thread.
+ *
+ * Requests are spread over a small pool of connections that are kept open and reused. Up to
+ * maxPipelineDepth requests are written to a connection before any of their answers come back, and the
+ * answers are matched to requests in order. Every request has a deadline. When it passes, the request
+ * completes with TimedOut, and its answer is thrown away if it ever arrives.
+ *
+ * Nothing here throws. Every request completes exactly once, through its future or its callback. Callbacks
+ * run on the event loop thread, so they should hand off anything slow instead of doing it themselves.
+ * Connects over plain TCP, or over the server's Unix domain socket. TLS connections still need TlsChannel.
+ */
+class FileClient
+{
+public:
+	using Callback = std::function<void(FetchResult)>;
+	using Clock = std::chrono::steady_clock;
+
+	struct Options {
+		std::string host = "127.0.0.1";
+		int port = 54000;
+		// When set, connect to the server's Unix domain socket at this path instead of host and port
+		std::string unixSocketPath;
+		// Connections only hold a server worker while a request on them is being read or answered, so this can
+		// go above the server's MAX_THREADS, but more connections than that don't get answered any sooner
+		size_t maxConnections = 4;
+		size_t maxPipelineDepth = 16;
+		// Close connections that have nothing to do before the server's keep-alive closes them under us
+		std::chrono::milliseconds idleTimeout = std::chrono::milliseconds(1000);
+		std::chrono::milliseconds connectTimeout = std::chrono::milliseconds(5000);
+		// Once the next answer on a connection is this far past its request's deadline, the server is taken to have
+		// stopped answering there. The connection is closed, and the requests behind it move to another one.
+		std::chrono::milliseconds stallGrace = std::chrono::milliseconds(500);
+	};
+
+	explicit FileClient(Options options = Options()) : m_options(options), m_stopping(false), m_wakeSocket(INVALID_SOCKET) {
+		// The event loop sleeps in WSAPoll, which only waits on sockets. Other threads wake it up by sending
+		// a datagram to a UDP socket bound to loopback that the loop polls along with the connections.
+		m_wakeSocket = socket(AF_INET, SOCK_DGRAM, 0);
+		sockaddr_in wakeAddress;
+		ZeroMemory(&wakeAddress, sizeof(wakeAddress));
+		wakeAddress.sin_family = AF_INET;
+		inet_pton(AF_INET, "127.0.0.1", &wakeAddress.sin_addr);
+		bind(m_wakeSocket, (sockaddr*)&wakeAddress, sizeof(wakeAddress));
+		int addressSize = sizeof(m_wakeAddress);
+		getsockname(m_wakeSocket, (sockaddr*)&m_wakeAddress, &addressSize);
+		u_long nonBlocking = 1;
+		ioctlsocket(m_wakeSocket, FIONBIO, &nonBlocking);
+
+		m_loop = std::thread(&FileClient::run, this);
+	}
+
+	// Requests that haven't completed yet complete with Failed
+	~FileClient() {
+		m_stopping = true;
+		wake();
+		m_loop.join();
+		closesocket(m_wakeSocket);
+	}
+
+	FileClient(const FileClient&) = delete;
+	FileClient& operator=(const FileClient&) = delete;
+
+	// Fetch a file. Pass the digest from an earlier result as knownDigest to get NotModified instead of
+	// the whole file again if it hasn't changed.
+	std::future<FetchResult> fetch(const std::string& name, std::chrono::milliseconds timeout, const std::string& knownDigest = "-") {
+		std::shared_ptr<std::promise<FetchResult>> promise = std::make_shared<std::promise<FetchResult>>();
+		std::future<FetchResult> future = promise->get_future();
+		fetch(name, timeout, knownDigest, [promise](FetchResult result) { promise->set_value(std::move(result)); });
+		return future;
+	}
+
+	void fetch(const std::string& name, std::chrono::milliseconds timeout, const std::string& knownDigest, Callback callback) {
+		submit("GET", name, timeout, knownDigest, std::move(callback));
+	}
+
+	// Like fetch(), but over a Unix domain socket the server shares the file through shared memory instead of
+	// sending it, and the result is Mapped. Anywhere else, or if the server can't share it, this is just fetch().
+	std::future<FetchResult> map(const std::string& name, std::chrono::milliseconds timeout, const std::string& knownDigest = "-") {
+		std::shared_ptr<std::promise<FetchResult>> promise = std::make_shared<std::promise<FetchResult>>();
+		std::future<FetchResult> future = promise->get_future();
+		map(name, timeout, knownDigest, [promise](FetchResult result) { promise->set_value(std::move(result)); });
+		return future;
+	}
+
+	void map(const std::string& name, std::chrono::milliseconds timeout, const std::string& knownDigest, Callback callback) {
+		submit("MAP", name, timeout, knownDigest, std::move(callback));
+	}
+
+private:
+	void submit(const std::string& verb, const std::string& name, std::chrono::milliseconds timeout, const std::string& knownDigest, Callback callback) {
+		std::shared_ptr<Request> request = std::make_shared<Request>();
+		request->line = verb + " " + (knownDigest.empty() ? std::string("-") : knownDigest) + " " + name + "\n";
+		request->deadline = Clock::now() + timeout;
+		request->callback = std::move(callback);
+		{
+			std::lock_guard<std::mutex> lock(m_submittedMu);
+			m_submitted.push_back(request);
+		}
+		wake();
+	}
+
+	static constexpr size_t PROMPT_LENGTH = sizeof("Please request a file: ") - 1;
+
+	struct Request {
+		std::string line;
+		Clock::time_point deadline;
+		Callback callback;
+		bool done = false;
+		// A request that was on a connection the server closed gets one more try on another connection
+		bool retried = false;
+	};
+
+	struct Connection {
+		enum class State { Connecting, Prompt, Ready };
+
+		SOCKET sock = INVALID_SOCKET;
+		State state = State::Connecting;
+		Clock::time_point since;
+		// Bytes waiting to be written, and bytes read but not parsed yet
+		std::string out;
+		std::string in;
+		// Requests written, or queued in out, in the order their answers will arrive
+		std::deque<std::shared_ptr<Request>> inFlight;
+		bool broken = false;
+	};
+
+	void wake() {
+		char byte = 0;
+		sendto(m_wakeSocket, &byte, 1, 0, (sockaddr*)&m_wakeAddress, sizeof(m_wakeAddress));
+	}
+
+	static void complete(Request& request, FetchResult result) {
+		if (request.done) {
+			return;
+		}
+		request.done = true;
+		request.callback(std::move(result));
+	}
+
+	static FetchResult failure(FetchResult::Status status, const std::string& error) {
+		FetchResult result;
+		result.status = status;
+		result.error = error;
+		return result;
+	}
+
+	void run() {
+		while (!m_stopping) {
+			{
+				std::lock_guard<std::mutex> lock(m_submittedMu);
+				m_waiting.insert(m_waiting.end(), m_submitted.begin(), m_submitted.end());
+				m_submitted.clear();
+			}
+			assignWaiting();
+			expireRequests();
+
+			std::vector<WSAPOLLFD> fds(1 + m_connections.size());
+			fds[0].fd = m_wakeSocket;
+			fds[0].events = POLLRDNORM;
+			for (size_t i = 0; i < m_connections.size(); i++) {
+				Connection& conn = *m_connections[i];
+				fds[i + 1].fd = conn.sock;
+				if (conn.state == Connection::State::Connecting) {
+					fds[i + 1].events = POLLWRNORM;
+				}
+				else {
+					fds[i + 1].events = POLLRDNORM | (conn.state == Connection::State::Ready && !conn.out.empty() ? POLLWRNORM : 0);
+				}
+			}
+			WSAPoll(fds.data(), static_cast<ULONG>(fds.size()), pollTimeoutMs());
+
+			if (fds[0].revents & POLLRDNORM) {
+				char drain[64];
+				while (recv(m_wakeSocket, drain, sizeof(drain), 0) > 0) {}
+			}
+			for (size_t i = 0; i < m_connections.size(); i++) {
+				service(*m_connections[i], fds[i + 1].revents);
+			}
+			closeBrokenAndIdle();
+		}
+
+		// Shutting down, nothing else will complete these
+		{
+			std::lock_guard<std::mutex> lock(m_submittedMu);
+			m_waiting.insert(m_waiting.end(), m_submitted.begin(), m_submitted.end());
+			m_submitted.clear();
+		}
+		for (auto& request : m_waiting) {
+			complete(*request, failure(FetchResult::Status::Failed, "FileClient is shutting down"));
+		}
+		for (auto& conn : m_connections) {
+			for (auto& request : conn->inFlight) {
+				complete(*request, failure(FetchResult::Status::Failed, "FileClient is shutting down"));
+			}
+			closesocket(conn->sock);
+		}
+	}
+
+	// Hand waiting requests to the connection with the fewest in flight, opening connections as needed
+	void assignWaiting() {
+		while (!m_waiting.empty()) {
+			Connection* best = nullptr;
+			for (auto& conn : m_connections) {
+				if (!conn->broken && conn->inFlight.size() < m_options.maxPipelineDepth &&
+					(best == nullptr || conn->inFlight.size() < best->inFlight.size())) {
+					best = conn.get();
+				}
+			}
+			// An idle connection is as good as it gets, otherwise a new one beats pipelining behind others
+			if ((best == nullptr || !best->inFlight.empty()) && m_connections.size() < m_options.maxConnections) {
+				Connection* opened = openConnection();
+				if (opened != nullptr) {
+					best = opened;
+				}
+			}
+			if (best == nullptr) {
+				return;
+			}
+
+			std::shared_ptr<Request> request = m_waiting.front();
+			m_waiting.pop_front();
+			if (request->done) {
+				continue;
+			}
+			best->out += request->line;
+			best->inFlight.push_back(request);
+		}
+	}
+
+	Connection* openConnection() {
+		bool local = !m_options.unixSocketPath.empty();
+		SOCKET sock = socket(local ? AF_UNIX : AF_INET, SOCK_STREAM, 0);
+		if (sock == INVALID_SOCKET) {
+			return nullptr;
+		}
+		u_long nonBlocking = 1;
+		ioctlsocket(sock, FIONBIO, &nonBlocking);
+
+		int connResult;
+		if (local) {
+			SOCKADDR_UN hint;
+			ZeroMemory(&hint, sizeof(hint));
+			hint.sun_family = AF_UNIX;
+			strncpy_s(hint.sun_path, m_options.unixSocketPath.c_str(), _TRUNCATE);
+			connResult = connect(sock, (sockaddr*)&hint, sizeof(hint));
+		}
+		else {
+			// Requests are small and we want them on the wire now, not batched up behind Nagle's algorithm
+			BOOL noDelay = TRUE;
+			setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, (const char*)&noDelay, sizeof(noDelay));
+
+			sockaddr_in hint;
+			ZeroMemory(&hint, sizeof(hint));
+			hint.sin_family = AF_INET;
+			hint.sin_port = htons(m_options.port);
+			inet_pton(AF_INET, m_options.host.c_str(), &hint.sin_addr);
+			connResult = connect(sock, (sockaddr*)&hint, sizeof(hint));
+		}
+		if (connResult == SOCKET_ERROR && WSAGetLastError() != WSAEWOULDBLOCK) {
+			closesocket(sock);
+			return nullptr;
+		}
+
+		std::unique_ptr<Connection> conn(new Connection());
+		conn->sock = sock;
+		conn->since = Clock::now();
+		m_connections.push_back(std::move(conn));
+		return m_connections.back().get();
+	}
+
+	void service(Connection& conn, SHORT revents) {
+		if (conn.broken || revents == 0) {
+			return;
+		}
+
+		if (conn.state == Connection::State::Connecting) {
+			int error = 0;
+			int errorSize = sizeof(error);
+			getsockopt(conn.sock, SOL_SOCKET, SO_ERROR, (char*)&error, &errorSize);
+			if ((revents & (POLLERR | POLLHUP)) || error != 0) {
+				conn.broken = true;
+				return;
+			}
+			conn.state = Connection::State::Prompt;
+			conn.since = Clock::now();
+		}
+
+		if (revents & (POLLRDNORM | POLLHUP | POLLERR)) {
+			readAvailable(conn);
+			parseResponses(conn);
+		}
+		if (!conn.broken && conn.state == Connection::State::Ready && !conn.out.empty()) {
+			int sent = send(conn.sock, conn.out.data(), static_cast<int>(std::min<size_t>(conn.out.size(), INT_MAX)), 0);
+			if (sent == SOCKET_ERROR) {
+				conn.broken = WSAGetLastError() != WSAEWOULDBLOCK;
+			}
+			else {
+				conn.out.erase(0, sent);
+			}
+		}
+	}
+
+	void readAvailable(Connection& conn) {
+		char buf[64 * 1024];
+		while (true) {
+			int byteCount = recv(conn.sock, buf, sizeof(buf), 0);
+			if (byteCount > 0) {
+				conn.in.append(buf, byteCount);
+				continue;
+			}
+			// 0 means the server closed the connection, anything but WSAEWOULDBLOCK is a real error
+			if (byteCount == 0 || WSAGetLastError() != WSAEWOULDBLOCK) {
+				conn.broken = true;
+			}
+			return;
+		}
+	}
+
+	// The handle value comes off the socket, so anyone who owns the socket file could name one of our own handles.
+	// Only take it once it's shown to be a section holding at least length bytes. If it isn't, we leave it open,
+	// since closing a handle we can't account for is worse than leaking one the server gave us.
+	static const char* mapSharedSection(HANDLE section, size_t length) {
+		DWORD flags = 0;
+		if (length == 0 || !GetHandleInformation(section, &flags) || (flags & HANDLE_FLAG_PROTECT_FROM_CLOSE)) {
+			return nullptr;
+		}
+		// Only succeeds on a section, and fails if it's smaller than length
+		const char* view = static_cast<const char*>(MapViewOfFile(section, FILE_MAP_READ, 0, 0, length));
+		if (view == nullptr) {
+			return nullptr;
+		}
+		MEMORY_BASIC_INFORMATION info = {};
+		if (VirtualQuery(view, &info, sizeof(info)) == 0 || info.RegionSize < length) {
+			UnmapViewOfFile(view);
+			return nullptr;
+		}
+		return view;
+	}
+
+	void parseResponses(Connection& conn) {
+		if (conn.state == Connection::State::Prompt) {
+			if (conn.in.size() < PROMPT_LENGTH) {
+				return;
+			}
+			conn.in.erase(0, PROMPT_LENGTH);
+			conn.state = Connection::State::Ready;
+		}
+
+		while (!conn.inFlight.empty()) {
+			size_t lineEnd = conn.in.find('\n');
+			if (lineEnd == std::string::npos) {
+				return;
+			}
+			std::istringstream statusLine(conn.in.substr(0, lineEnd));
+			std::string status;
+			FetchResult result;
+			statusLine >> status >> result.digest;
+
+			size_t consumed = lineEnd + 1;
+			if (status == "OK") {
+				size_t length = 0;
+				statusLine >> length;
+				if (conn.in.size() - consumed < length) {
+					return;
+				}
+				result.status = FetchResult::Status::Ok;
+				result.contents = conn.in.substr(consumed, length);
+				consumed += length;
+			}
+			else if (status == "MAPPED" && !m_options.unixSocketPath.empty()) {
+				// The server already put a handle to the section in our process, so it's ours to close.
+				// Only a server on this machine can do that, so MAPPED from anywhere else is a protocol error.
+				size_t length = 0;
+				unsigned long long handleValue = 0;
+				statusLine >> length >> handleValue;
+				HANDLE section = reinterpret_cast<HANDLE>(static_cast<ULONG_PTR>(handleValue));
+				const char* view = mapSharedSection(section, length);
+				if (view == nullptr) {
+					result = failure(FetchResult::Status::Failed, "can't map the file the server shared");
+				}
+				else {
+					result.status = FetchResult::Status::Mapped;
+					result.mapped = std::make_shared<const MappedFile>(section, view, length);
+				}
+			}
+			else if (status == "SAME") {
+				result.status = FetchResult::Status::NotModified;
+			}
+			else if (status == "MISSING") {
+				result.status = FetchResult::Status::Missing;
+				result.digest.clear();
+			}
+			else {
+				// We can't tell where this answer ends, so nothing after it on this connection can be trusted
+				conn.broken = true;
+				return;
+			}
+
+			conn.in.erase(0, consumed);
+			std::shared_ptr<Request> request = conn.inFlight.front();
+			conn.inFlight.pop_front();
+			complete(*request, std::move(result));
+			conn.since = Clock::now();
+		}
+	}
+
+	// Time out requests whose deadline has passed, wherever they are
+	void expireRequests() {
+		Clock::time_point now = Clock::now();
+		for (auto it = m_waiting.begin(); it != m_waiting.end();) {
+			if ((*it)->deadline <= now) {
+				complete(**it, failure(FetchResult::Status::TimedOut, "deadline passed before the request was sent"));
+				it = m_waiting.erase(it);
+			}
+			else {
+				++it;
+			}
+		}
+		for (auto& conn : m_connections) {
+			// Their answers still have to be read off the connection to keep the rest in order, so they stay in inFlight
+			for (auto& request : conn->inFlight) {
+				if (request->deadline <= now) {
+					complete(*request, failure(FetchResult::Status::TimedOut, "deadline passed before the answer arrived"));
+				}
+			}
+			if (conn->state == Connection::State::Connecting && now - conn->since > m_options.connectTimeout) {
+				conn->broken = true;
+			}
+			// Otherwise a connection the server stopped answering would keep its timed out requests forever,
+			// never count as idle, and every request pipelined behind them would time out too
+			if (!conn->inFlight.empty() && conn->inFlight.front()->deadline + m_options.stallGrace <= now) {
+				conn->broken = true;
+			}
+		}
+	}
+
+	void closeBrokenAndIdle() {
+		Clock::time_point now = Clock::now();
+		for (auto it = m_connections.begin(); it != m_connections.end();) {
+			Connection& conn = **it;
+			bool idle = conn.inFlight.empty() && now - conn.since > m_options.idleTimeout;
+			if (!conn.broken && !idle) {
+				++it;
+				continue;
+			}
+
+			// GET is safe to repeat, so requests the server never answered go round once more before failing
+			for (auto request = conn.inFlight.rbegin(); request != conn.inFlight.rend(); ++request) {
+				if ((*request)->done) {
+					continue;
+				}
+				if (!(*request)->retried) {
+					(*request)->retried = true;
+					m_waiting.push_front(*request);
+				}
+				else {
+					complete(**request, failure(FetchResult::Status::Failed, "connection to the server was lost"));
+				}
+			}
+			closesocket(conn.sock);
+			it = m_connections.erase(it);
+		}
+	}
+
+	// Sleep until the next deadline or idle check, but never so long that a stuck connect goes unnoticed
+	int pollTimeoutMs() {
+		Clock::time_point now = Clock::now();
+		Clock::time_point next = now + std::chrono::milliseconds(250);
+		// (std::min) in parentheses so windows.h's min macro doesn't get in the way
+		for (auto& request : m_waiting) {
+			next = (std::min)(next, request->deadline);
+		}
+		for (auto& conn : m_connections) {
+			for (auto& request : conn->inFlight) {
+				if (!request->done) {
+					next = (std::min)(next, request->deadline);
+				}
+			}
+		}
+		auto wait = std::chrono::duration_cast<std::chrono::milliseconds>(next - now).count();
+		return wait > 0 ? static_cast<int>(wait) : 0;
+	}
+
+	Options m_options;
+	std::atomic<bool> m_stopping;
+	SOCKET m_wakeSocket;
+	sockaddr_in m_wakeAddress;
+	std::thread m_loop;
+
+	// mutex for requests submitted from other threads that the loop hasn't picked up yet
+	std::mutex m_submittedMu;
+	std::vector<std::shared_ptr<Request>> m_submitted;
+
+	// Everything below belongs to the event loop thread
+	std::deque<std::shared_ptr<Request>> m_waiting;
+	std::vector<std::unique_ptr<Connection>> m_connections;
+};
@@ -0,0 +1,160 @@
+#pragma once
+#include <WS2tcpip.h>
+#include <afunix.h>
+
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "FileCache.h"
+
+/*
+ * Read-only shared memory copies of files, for clients on the same machine.
+ *
+ * A client connected over the Unix domain socket can ask for a file to be mapped instead of sent. The server
+ * copies the file into an unnamed section once, and duplicates a read-only handle to that section straight
+ * into the client's process. Windows' AF_UNIX has no SCM_RIGHTS, but it can tell us the process at the other
+ * end of the socket, which is all DuplicateHandle needs. The client then maps the section and reads the file
+ * without any of it going through a socket.
+ *
+ * The handle in the client's process belongs to the client as soon as it's duplicated. If the answer naming it
+ * can't be sent, the server closes it again in the client with revoke(). If the answer was sent but the client
+ * never reads it, because it hung up or shut down with the request in flight, the handle stays open in the
+ * client until the client closes it or exits. Windows closes every handle of a process when it exits.
+ *
+ * Sections are kept by digest, so a file that changes gets a new section, and clients still holding the old
+ * one keep a consistent copy of the version they asked for. Once the sections add up to more than maxBytes
+ * the least recently used are closed, which doesn't affect clients that already have a handle to them.
+ */
+class FileMappings
+{
+public:
+	using Section = std::shared_ptr<void>;
+
+	FileMappings(size_t maxBytes = 256 << 20) : m_maxBytes(maxBytes), m_bytes(0) {}
+
+	// The section holding the file's bytes, created on first use. nullptr if it can't be created,
+	// or if the file changed since entry was looked up.
+	Section get(const std::string& path, const FileCache::Entry& entry) {
+		{
+			std::lock_guard<std::mutex> lock(m_mu);
+			auto it = m_sections.find(entry.digest);
+			if (it != m_sections.end()) {
+				m_lru.splice(m_lru.begin(), m_lru, it->second.lruPosition);
+				return it->second.section;
+			}
+		}
+
+		Section section = create(path, entry);
+		if (!section) {
+			return nullptr;
+		}
+
+		std::lock_guard<std::mutex> lock(m_mu);
+		// Another thread may have created one for the same digest in the meantime, either is fine
+		auto it = m_sections.find(entry.digest);
+		if (it != m_sections.end()) {
+			return it->second.section;
+		}
+		m_lru.push_front(entry.digest);
+		Cached cached;
+		cached.section = section;
+		cached.size = static_cast<size_t>(entry.size);
+		cached.lruPosition = m_lru.begin();
+		m_sections.emplace(entry.digest, cached);
+		m_bytes += cached.size;
+
+		while (m_bytes > m_maxBytes && m_lru.size() > 1) {
+			auto oldest = m_sections.find(m_lru.back());
+			m_bytes -= oldest->second.size;
+			m_sections.erase(oldest);
+			m_lru.pop_back();
+		}
+		return section;
+	}
+
+	// The process at the other end of a Unix domain socket, opened so handles can be put into it. Keeping it
+	// open also keeps its process id from being reused. nullptr if it can't be opened.
+	using Peer = std::shared_ptr<void>;
+
+	static Peer peerOf(SOCKET sock) {
+		ULONG peerPid = 0;
+		DWORD bytes = 0;
+		if (WSAIoctl(sock, SIO_AF_UNIX_GETPEERPID, nullptr, 0, &peerPid, sizeof(peerPid), &bytes, nullptr, nullptr) != 0) {
+			return nullptr;
+		}
+		HANDLE peer = OpenProcess(PROCESS_DUP_HANDLE, FALSE, peerPid);
+		if (peer == nullptr) {
+			return nullptr;
+		}
+		return Peer(peer, [](void* h) { CloseHandle(h); });
+	}
+
+	// Duplicate a read-only handle to section into peer. remoteHandle is the handle's value in that process,
+	// which is only meaningful to that process. From then on the handle belongs to the peer.
+	static bool shareWith(const Peer& peer, const Section& section, unsigned long long& remoteHandle) {
+		HANDLE remote = nullptr;
+		BOOL duplicated = DuplicateHandle(GetCurrentProcess(), section.get(), peer.get(), &remote, FILE_MAP_READ, FALSE, 0);
+		remoteHandle = static_cast<unsigned long long>(reinterpret_cast<ULONG_PTR>(remote));
+		return duplicated != FALSE;
+	}
+
+	// Close a handle shareWith() put in peer, for when the peer never got told about it
+	static void revoke(const Peer& peer, unsigned long long remoteHandle) {
+		HANDLE remote = reinterpret_cast<HANDLE>(static_cast<ULONG_PTR>(remoteHandle));
+		DuplicateHandle(peer.get(), remote, nullptr, nullptr, 0, FALSE, DUPLICATE_CLOSE_SOURCE);
+	}
+
+private:
+	struct Cached {
+		Section section;
+		size_t size;
+		std::list<std::string>::iterator lruPosition;
+	};
+
+	static Section create(const std::string& path, const FileCache::Entry& entry) {
+		// A section can't be empty, and there's nothing to share anyway
+		if (entry.size == 0) {
+			return nullptr;
+		}
+		HANDLE handle = CreateFileMappingA(INVALID_HANDLE_VALUE, nullptr, PAGE_READWRITE,
+			static_cast<DWORD>(entry.size >> 32), static_cast<DWORD>(entry.size), nullptr);
+		if (handle == nullptr) {
+			return nullptr;
+		}
+		Section section(handle, [](void* h) { CloseHandle(h); });
+
+		char* view = static_cast<char*>(MapViewOfFile(handle, FILE_MAP_WRITE, 0, 0, static_cast<SIZE_T>(entry.size)));
+		if (view == nullptr) {
+			return nullptr;
+		}
+
+		bool filled = true;
+		if (entry.contents) {
+			memcpy(view, entry.contents->data(), entry.contents->size());
+		}
+		else {
+			// Too big for the cache, so read it from disk straight into the section, and make sure
+			// it's still the version the digest was computed from
+			std::ifstream f(path, std::ios::binary);
+			f.read(view, static_cast<std::streamsize>(entry.size));
+			Sha256 hash;
+			hash.update(view, static_cast<size_t>(f.gcount()));
+			filled = static_cast<ULONGLONG>(f.gcount()) == entry.size && hash.hexDigest() == entry.digest;
+		}
+		UnmapViewOfFile(view);
+		return filled ? section : nullptr;
+	}
+
+	size_t m_maxBytes;
+
+	// mutex for everything below
+	std::mutex m_mu;
+	size_t m_bytes;
+	std::unordered_map<std::string, Cached> m_sections;
+	// most recently used at the front
+	std::list<std::string> m_lru;
+};
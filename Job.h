@@ -0,0 +1,76 @@
+#pragma once
+#include <WS2tcpip.h>
+
+#include <fstream>
+#include <memory>
+#include <queue>
+#include <string>
+#include <vector>
+
+#include "FileMappings.h"
+#include "Sha256.h"
+#include "TlsChannel.h"
+
+// How many bytes a job's priority improves by for every ms its response has been waiting. Without this
+// a steady stream of small requests could hold a big transfer back forever. At 16KB per ms a 4MB response
+// goes ahead of newly arrived small ones once it has been waiting about a quarter of a second. Much faster
+// aging lets big transfers cut in front of small requests that only just arrived, and readyAt comes from
+// GetTickCount64(), so it jumps by a whole 15.6ms tick's worth at a time.
+static constexpr unsigned long long AGING_BYTES_PER_MS = 16 * 1024;
+
+/*
+ * A connection, and everything a worker needs to carry on from where the last one left off.
+ * A job is either waiting for its next request, or part of the way through sending a response.
+ */
+struct Job {
+	SOCKET clientSocket = INVALID_SOCKET;
+	std::unique_ptr<TlsChannel> channel;
+	int userNumber = 0;
+	// The TLS handshake and the prompt are done
+	bool started = false;
+	// The client speaks the digest protocol, so the connection stays open between requests
+	bool keepAlive = false;
+	bool local = false;
+	// Received but not handled yet, pipelined requests wait in here
+	std::string request;
+
+	// There's a response on its way, made of whatever is left below, sent in this order
+	bool responding = false;
+	std::string pending;
+	std::shared_ptr<const std::string> contents;
+	size_t contentsOffset = 0;
+	std::unique_ptr<std::ifstream> file;
+	unsigned long long fileRemaining = 0;
+	// The client's process, and a section handle put in it that the client hasn't been told about yet
+	FileMappings::Peer peer;
+	unsigned long long sharedHandle = 0;
+	// Set when the file's digest has already been sent, to hash the file again as it goes out
+	std::unique_ptr<Sha256> fileHash;
+	std::string fileDigest;
+
+	// When the connection was accepted, or the current response was ready to send, in ms
+	ULONGLONG readyAt = 0;
+	unsigned long long priority = 0;
+	unsigned long long sequence = 0;
+
+	unsigned long long remaining() const {
+		return pending.size() + (contents ? contents->size() - contentsOffset : 0) + fileRemaining;
+	}
+
+	// Set priority before the job goes on the queue. A job waiting for a request has nothing to send yet, so the
+	// sooner the request is read, the sooner we know how big the response is. Since every job ages at the same
+	// rate, this static key orders the queue the same way as remaining - waited * AGING_BYTES_PER_MS would at any moment.
+	void prioritize() {
+		priority = remaining() + readyAt * AGING_BYTES_PER_MS;
+	}
+};
+
+// Puts the job with the lowest priority value at the top of the queue, and the one queued first when they tie
+struct JobOrder {
+	bool operator()(const std::shared_ptr<Job>& a, const std::shared_ptr<Job>& b) const {
+		return a->priority != b->priority ? a->priority > b->priority : a->sequence > b->sequence;
+	}
+};
+
+// The queue ThreadPoolServerImproved's workers take jobs from
+using JobQueue = std::priority_queue<std::shared_ptr<Job>, std::vector<std::shared_ptr<Job>>, JobOrder>;
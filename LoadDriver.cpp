@@ -0,0 +1,400 @@
+#include <WS2tcpip.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <random>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "SocketUtils.h"
+
+#pragma comment (lib, "ws2_32.lib")
+
+/*
+ * End-to-end load driver. It generates a fixed set of files, optionally starts one of the servers,
+ * and then runs the same scenarios against it over loopback every time:
+ *
+ *   small_files  - lots of requests for many small files
+ *   large_files  - a few requests for a few multi-megabyte files
+ *   slow_clients - a quarter of the clients wait before asking for their file, holding their connection open
+ *   mixed_small  - small and large requests interleaved, only the small requests are timed
+ *
+ * Every scenario prints a CSV row, and can be compared against a baseline CSV to catch regressions.
+ *
+ * Usage: LoadDriver.exe [--server <exe>] [--label <name>] [--out <csv>] [--baseline <csv>] [--tolerance <fraction>]
+ */
+
+static const std::string IP_ADDRESS = "127.0.0.1";
+static const int PORT = 54000;
+static const std::string FIXTURE_DIR = "bench_files";
+static const std::string PROMPT = "Please request a file: ";
+
+static constexpr int NUM_SMALL_FILES = 200;
+static constexpr int NUM_LARGE_FILES = 4;
+static constexpr size_t LARGE_FILE_SIZE = 4 << 20;
+static constexpr int SLOW_CLIENT_DELAY_MS = 50;
+
+struct Fixture {
+	std::string name;
+	std::string contents;
+};
+
+struct Scenario {
+	std::string name;
+	int requests;
+	int concurrency;
+	// Every nth request is for a large file, 0 for none
+	int largeEvery;
+	// Every nth client sleeps for SLOW_CLIENT_DELAY_MS before asking for its file, 0 for none
+	int slowEvery;
+	// Whether only the small requests are timed
+	bool timeSmallOnly;
+};
+
+struct ScenarioResult {
+	std::string label;
+	std::string scenario;
+	int requests = 0;
+	int errors = 0;
+	double seconds = 0;
+	double requestsPerSec = 0;
+	double p50Us = 0;
+	double p99Us = 0;
+	double maxUs = 0;
+};
+
+// Generate the files every run uses. The seed is fixed, so every run, on every machine, serves the same bytes.
+// Text only, and no '\r', so the servers reading in text mode send back exactly what's on disk.
+static std::vector<Fixture> writeFixtures(const std::string& prefix, int count, size_t minSize, size_t maxSize, unsigned seed) {
+	CreateDirectoryA(FIXTURE_DIR.c_str(), nullptr);
+	std::mt19937 rng(seed);
+	std::uniform_int_distribution<size_t> sizes(minSize, maxSize);
+	std::uniform_int_distribution<int> printable('a', 'z');
+
+	std::vector<Fixture> fixtures;
+	for (int i = 0; i < count; i++) {
+		Fixture fixture;
+		fixture.name = FIXTURE_DIR + "\\" + prefix + std::to_string(i) + ".txt";
+		fixture.contents.resize(sizes(rng));
+		for (size_t j = 0; j < fixture.contents.size(); j++) {
+			fixture.contents[j] = (j % 80 == 79) ? '\n' : static_cast<char>(printable(rng));
+		}
+		std::ofstream f(fixture.name, std::ios::binary);
+		f << fixture.contents;
+		fixtures.push_back(fixture);
+	}
+	return fixtures;
+}
+
+// Request one file and check every byte that comes back. Returns false on any error.
+static bool fetchFile(const Fixture& fixture, bool slow) {
+	SOCKET sock = socket(AF_INET, SOCK_STREAM, 0);
+	if (sock == INVALID_SOCKET) {
+		return false;
+	}
+
+	sockaddr_in hint;
+	hint.sin_family = AF_INET;
+	hint.sin_port = htons(PORT);
+	inet_pton(AF_INET, IP_ADDRESS.c_str(), &hint.sin_addr);
+	if (connect(sock, (sockaddr*)&hint, sizeof(hint)) == SOCKET_ERROR) {
+		closesocket(sock);
+		return false;
+	}
+
+	const int BUFSIZE = 64 * 1024;
+	std::vector<char> buf(BUFSIZE);
+
+	// Wait for the whole prompt, otherwise the filename could arrive glued to nothing the server expects
+	size_t promptBytes = 0;
+	while (promptBytes < PROMPT.size()) {
+		int byteCount = recv(sock, buf.data(), static_cast<int>(PROMPT.size() - promptBytes), 0);
+		if (byteCount <= 0) {
+			closesocket(sock);
+			return false;
+		}
+		promptBytes += byteCount;
+	}
+
+	if (slow) {
+		Sleep(SLOW_CLIENT_DELAY_MS);
+	}
+	if (!sendAll(sock, fixture.name)) {
+		closesocket(sock);
+		return false;
+	}
+
+	// The server closes the connection once the file has been sent
+	std::string received;
+	received.reserve(fixture.contents.size());
+	while (true) {
+		int byteCount = recv(sock, buf.data(), BUFSIZE, 0);
+		if (byteCount == SOCKET_ERROR) {
+			closesocket(sock);
+			return false;
+		}
+		if (byteCount == 0) {
+			break;
+		}
+		received.append(buf.data(), byteCount);
+	}
+	closesocket(sock);
+	return received == fixture.contents;
+}
+
+static double percentile(std::vector<double>& sorted, double p) {
+	if (sorted.empty()) {
+		return 0;
+	}
+	size_t index = static_cast<size_t>(p * (sorted.size() - 1) + 0.5);
+	// In parentheses so windows.h's min macro doesn't get in the way
+	return sorted[(std::min)(index, sorted.size() - 1)];
+}
+
+static ScenarioResult runScenario(const std::string& label, const Scenario& scenario,
+	const std::vector<Fixture>& smallFiles, const std::vector<Fixture>& largeFiles) {
+	std::vector<std::vector<double>> latencies(scenario.concurrency);
+	std::atomic<int> errors(0);
+
+	auto start = std::chrono::steady_clock::now();
+	std::vector<std::thread> clients;
+	for (int c = 0; c < scenario.concurrency; c++) {
+		// Client c always makes requests c, c + concurrency, c + 2 * concurrency, ... so runs are repeatable
+		clients.emplace_back([&, c] {
+			for (int i = c; i < scenario.requests; i += scenario.concurrency) {
+				bool large = scenario.largeEvery > 0 && i % scenario.largeEvery == 0;
+				bool slow = scenario.slowEvery > 0 && i % scenario.slowEvery == 0;
+				const Fixture& fixture = large ? largeFiles[i % largeFiles.size()] : smallFiles[i % smallFiles.size()];
+
+				auto requestStart = std::chrono::steady_clock::now();
+				if (!fetchFile(fixture, slow)) {
+					errors++;
+					continue;
+				}
+				auto requestEnd = std::chrono::steady_clock::now();
+				if (!scenario.timeSmallOnly || !large) {
+					latencies[c].push_back(std::chrono::duration<double, std::micro>(requestEnd - requestStart).count());
+				}
+			}
+		});
+	}
+	for (auto& client : clients) {
+		client.join();
+	}
+	auto end = std::chrono::steady_clock::now();
+
+	std::vector<double> all;
+	for (auto& clientLatencies : latencies) {
+		all.insert(all.end(), clientLatencies.begin(), clientLatencies.end());
+	}
+	std::sort(all.begin(), all.end());
+
+	ScenarioResult result;
+	result.label = label;
+	result.scenario = scenario.name;
+	result.requests = scenario.requests;
+	result.errors = errors.load();
+	result.seconds = std::chrono::duration<double>(end - start).count();
+	result.requestsPerSec = scenario.requests / result.seconds;
+	result.p50Us = percentile(all, 0.50);
+	result.p99Us = percentile(all, 0.99);
+	result.maxUs = all.empty() ? 0 : all.back();
+	return result;
+}
+
+static const std::string CSV_HEADER = "label,scenario,requests,errors,seconds,requests_per_sec,p50_us,p99_us,max_us";
+
+static std::string toCsv(const ScenarioResult& r) {
+	std::ostringstream ss;
+	ss << std::fixed << std::setprecision(3) << r.label << "," << r.scenario << "," << r.requests << "," << r.errors << ","
+		<< r.seconds << "," << r.requestsPerSec << "," << r.p50Us << "," << r.p99Us << "," << r.maxUs;
+	return ss.str();
+}
+
+static std::vector<ScenarioResult> readCsv(const std::string& path) {
+	std::vector<ScenarioResult> results;
+	std::ifstream f(path);
+	std::string line;
+	while (std::getline(f, line)) {
+		if (line.empty() || line == CSV_HEADER) {
+			continue;
+		}
+		std::istringstream ss(line);
+		std::vector<std::string> fields;
+		std::string field;
+		while (std::getline(ss, field, ',')) {
+			fields.push_back(field);
+		}
+		if (fields.size() != 9) {
+			continue;
+		}
+		ScenarioResult r;
+		r.label = fields[0];
+		r.scenario = fields[1];
+		r.requests = std::stoi(fields[2]);
+		r.errors = std::stoi(fields[3]);
+		r.seconds = std::stod(fields[4]);
+		r.requestsPerSec = std::stod(fields[5]);
+		r.p50Us = std::stod(fields[6]);
+		r.p99Us = std::stod(fields[7]);
+		r.maxUs = std::stod(fields[8]);
+		results.push_back(r);
+	}
+	return results;
+}
+
+// Compare against the baseline row with the same label and scenario. Throughput may not drop, and p99 may not
+// grow, by more than the tolerance, and there may not be any new errors. Returns false on a regression.
+static bool checkBaseline(const ScenarioResult& r, const std::vector<ScenarioResult>& baseline, double tolerance) {
+	for (const ScenarioResult& b : baseline) {
+		if (b.label != r.label || b.scenario != r.scenario) {
+			continue;
+		}
+		bool ok = true;
+		if (r.errors > b.errors) {
+			std::cerr << "REGRESSION " << r.label << "/" << r.scenario << ": " << r.errors << " errors, baseline " << b.errors << std::endl;
+			ok = false;
+		}
+		if (r.requestsPerSec < b.requestsPerSec * (1.0 - tolerance)) {
+			std::cerr << "REGRESSION " << r.label << "/" << r.scenario << ": " << r.requestsPerSec << " req/s, baseline " << b.requestsPerSec << std::endl;
+			ok = false;
+		}
+		if (r.p99Us > b.p99Us * (1.0 + tolerance)) {
+			std::cerr << "REGRESSION " << r.label << "/" << r.scenario << ": p99 " << r.p99Us << "us, baseline " << b.p99Us << "us" << std::endl;
+			ok = false;
+		}
+		return ok;
+	}
+	std::cerr << "No baseline for " << r.label << "/" << r.scenario << ", skipping the check" << std::endl;
+	return true;
+}
+
+// Start the server with its output thrown away, since printing to the console would be most of what we measure
+static bool startServer(const std::string& exe, PROCESS_INFORMATION& process, const Fixture& probe) {
+	SECURITY_ATTRIBUTES sa = { sizeof(sa), nullptr, TRUE };
+	HANDLE nul = CreateFileA("NUL", GENERIC_WRITE, FILE_SHARE_WRITE, &sa, OPEN_EXISTING, 0, nullptr);
+
+	STARTUPINFOA startup;
+	ZeroMemory(&startup, sizeof(startup));
+	startup.cb = sizeof(startup);
+	startup.dwFlags = STARTF_USESTDHANDLES;
+	startup.hStdInput = GetStdHandle(STD_INPUT_HANDLE);
+	startup.hStdOutput = nul;
+	startup.hStdError = nul;
+
+	std::string commandLine = "\"" + exe + "\"";
+	ZeroMemory(&process, sizeof(process));
+	BOOL created = CreateProcessA(nullptr, &commandLine[0], nullptr, nullptr, TRUE, 0, nullptr, nullptr, &startup, &process);
+	CloseHandle(nul);
+	if (!created) {
+		return false;
+	}
+
+	// Wait for it to start listening. Each attempt is a whole request rather than a bare connect, so the
+	// server isn't left handling a client that hangs up before asking for anything.
+	for (int attempt = 0; attempt < 100; attempt++) {
+		if (fetchFile(probe, false)) {
+			return true;
+		}
+		Sleep(50);
+	}
+	TerminateProcess(process.hProcess, 1);
+	return false;
+}
+
+int main(int argc, char* argv[]) {
+	std::string serverExe;
+	std::string label = "server";
+	std::string outPath;
+	std::string baselinePath;
+	double tolerance = 0.15;
+	for (int i = 1; i + 1 < argc; i += 2) {
+		std::string arg = argv[i];
+		if (arg == "--server") {
+			serverExe = argv[i + 1];
+		}
+		else if (arg == "--label") {
+			label = argv[i + 1];
+		}
+		else if (arg == "--out") {
+			outPath = argv[i + 1];
+		}
+		else if (arg == "--baseline") {
+			baselinePath = argv[i + 1];
+		}
+		else if (arg == "--tolerance") {
+			tolerance = std::stod(argv[i + 1]);
+		}
+		else {
+			std::cerr << "Unknown argument " << arg << std::endl;
+			return 2;
+		}
+	}
+
+	WSADATA wsData;
+	WORD ver = MAKEWORD(2, 2);
+	int wsOk = WSAStartup(ver, &wsData);
+	if (wsOk != 0) {
+		std::cerr << "can't initialize winsock! quitting!" << std::endl;
+		return 2;
+	}
+
+	std::vector<Fixture> smallFiles = writeFixtures("small_", NUM_SMALL_FILES, 64, 4096, 54000);
+	std::vector<Fixture> largeFiles = writeFixtures("large_", NUM_LARGE_FILES, LARGE_FILE_SIZE, LARGE_FILE_SIZE, 54001);
+
+	// The server serves files relative to its working directory, which it inherits from us
+	PROCESS_INFORMATION process;
+	if (!serverExe.empty() && !startServer(serverExe, process, smallFiles[0])) {
+		std::cerr << "Can't start " << serverExe << ", quitting" << std::endl;
+		WSACleanup();
+		return 2;
+	}
+
+	const std::vector<Scenario> scenarios = {
+		{ "small_files", 2000, 32, 0, 0, false },
+		{ "large_files", 40, 8, 1, 0, false },
+		{ "slow_clients", 400, 32, 0, 4, false },
+		{ "mixed_small", 1000, 32, 10, 0, true },
+	};
+
+	std::vector<ScenarioResult> baseline;
+	if (!baselinePath.empty()) {
+		baseline = readCsv(baselinePath);
+	}
+
+	std::ofstream out;
+	if (!outPath.empty()) {
+		bool exists = std::ifstream(outPath).good();
+		out.open(outPath, std::ios::app);
+		if (!exists) {
+			out << CSV_HEADER << std::endl;
+		}
+	}
+
+	std::cout << CSV_HEADER << std::endl;
+	bool passed = true;
+	for (const Scenario& scenario : scenarios) {
+		ScenarioResult result = runScenario(label, scenario, smallFiles, largeFiles);
+		std::cout << toCsv(result) << std::endl;
+		if (out.is_open()) {
+			out << toCsv(result) << std::endl;
+		}
+		if (!baselinePath.empty() && !checkBaseline(result, baseline, tolerance)) {
+			passed = false;
+		}
+	}
+
+	if (!serverExe.empty()) {
+		TerminateProcess(process.hProcess, 0);
+		CloseHandle(process.hProcess);
+		CloseHandle(process.hThread);
+	}
+	WSACleanup();
+	return passed ? 0 : 1;
+}
@@ -0,0 +1,218 @@
+#pragma once
+#include <WS2tcpip.h>
+
+#include <cctype>
+#include <cstring>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+/*
+ * Resolves the filename a client asked for to a file beneath the serving directory.
+ *
+ * The request is canonicalised lexically before the filesystem is touched, so anything that could
+ * walk out of the serving directory (absolute paths, drive letters, "..", alternate data streams,
+ * device names) is rejected straight away. The file is then opened, and the path Windows actually
+ * opened, after following any junctions or symlinks on the way, has to be beneath the serving directory.
+ * Checking the opened handle rather than the path means a directory swapped for a junction between
+ * the check and the open can't sneak a file from elsewhere past us.
+ *
+ * The handle is handed back to the caller as a Pin. It's opened without FILE_SHARE_DELETE, so while it's
+ * held neither the file nor any directory above it can be renamed or deleted, and opening resolvedPath again
+ * reaches the same file that was checked. Callers keep the Pin until they have opened the file themselves.
+ *
+ * Files that don't exist are kept in a small bounded cache for a short time, so clients asking for the
+ * same missing file over and over are answered from memory instead of going to the disk every time.
+ */
+class PathResolver
+{
+public:
+	enum class Result { Found, Missing, Rejected };
+
+	using Pin = std::shared_ptr<void>;
+
+	PathResolver(const std::string& root = ".", size_t maxCachedEntries = 4096, ULONGLONG missingTtlMs = 1000)
+		: m_maxCachedEntries(maxCachedEntries), m_missingTtlMs(missingTtlMs) {
+		char fullRoot[MAX_PATH];
+		DWORD len = GetFullPathNameA(root.c_str(), MAX_PATH, fullRoot, nullptr);
+		m_root = (len > 0 && len < MAX_PATH) ? std::string(fullRoot, len) : root;
+		if (m_root.empty() || m_root.back() != '\\') {
+			m_root += '\\';
+		}
+
+		// The serving directory may itself be reached through a junction, so compare against where it really is
+		HANDLE rootHandle = CreateFileA(m_root.c_str(), FILE_READ_ATTRIBUTES, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+			nullptr, OPEN_EXISTING, FILE_FLAG_BACKUP_SEMANTICS, nullptr);
+		if (rootHandle != INVALID_HANDLE_VALUE) {
+			m_finalRoot = finalPath(rootHandle);
+			CloseHandle(rootHandle);
+		}
+		if (!m_finalRoot.empty() && m_finalRoot.back() != '\\') {
+			m_finalRoot += '\\';
+		}
+	}
+
+	const std::string& root() const { return m_root; }
+
+	// Resolve the raw bytes a client sent. resolvedPath and pin are only filled in when the result is Found.
+	Result resolve(const std::string& request, std::string& resolvedPath, Pin& pin) {
+		std::string relative;
+		if (!canonicalise(request, relative)) {
+			return Result::Rejected;
+		}
+
+		if (isKnownMissing(relative)) {
+			return Result::Missing;
+		}
+
+		// FILE_FLAG_OPEN_REPARSE_POINT opens a symlink itself rather than whatever it points to
+		std::string fullPath = m_root + relative;
+		HANDLE handle = CreateFileA(fullPath.c_str(), FILE_READ_ATTRIBUTES, FILE_SHARE_READ | FILE_SHARE_WRITE,
+			nullptr, OPEN_EXISTING, FILE_FLAG_OPEN_REPARSE_POINT, nullptr);
+		if (handle == INVALID_HANDLE_VALUE) {
+			DWORD error = GetLastError();
+			if (error == ERROR_FILE_NOT_FOUND || error == ERROR_PATH_NOT_FOUND) {
+				rememberMissing(relative);
+			}
+			return Result::Missing;
+		}
+		Pin opened(handle, [](void* h) { CloseHandle(h); });
+
+		BY_HANDLE_FILE_INFORMATION info;
+		if (!GetFileInformationByHandle(handle, &info) || (info.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)) {
+			rememberMissing(relative);
+			return Result::Missing;
+		}
+		// A symlink could point anywhere on the disk, so never follow one
+		if (info.dwFileAttributes & FILE_ATTRIBUTE_REPARSE_POINT) {
+			return Result::Rejected;
+		}
+
+		std::string openedPath = finalPath(handle);
+		if (m_finalRoot.empty() || openedPath.size() <= m_finalRoot.size() ||
+			_strnicmp(openedPath.c_str(), m_finalRoot.c_str(), m_finalRoot.size()) != 0) {
+			return Result::Rejected;
+		}
+
+		resolvedPath = fullPath;
+		pin = opened;
+		return Result::Found;
+	}
+
+private:
+	// Turn the request into a relative path of the form "dir\\file", or return false if it
+	// could refer to anything outside of the serving directory.
+	static bool canonicalise(const std::string& request, std::string& relative) {
+		if (request.empty() || request.size() >= MAX_PATH) {
+			return false;
+		}
+		// Absolute and UNC paths
+		if (request[0] == '/' || request[0] == '\\') {
+			return false;
+		}
+
+		std::string component;
+		for (size_t i = 0; i <= request.size(); i++) {
+			char c = i < request.size() ? request[i] : '\\';
+			if (c != '/' && c != '\\') {
+				// ':' covers both drive letters and alternate data streams
+				if (static_cast<unsigned char>(c) < 0x20 || strchr(":*?\"<>|", c) != nullptr) {
+					return false;
+				}
+				component += c;
+				continue;
+			}
+
+			if (component.empty() || component == ".") {
+				component.clear();
+				continue;
+			}
+			if (!isSafeComponent(component)) {
+				return false;
+			}
+			if (!relative.empty()) {
+				relative += '\\';
+			}
+			relative += component;
+			component.clear();
+		}
+		return !relative.empty();
+	}
+
+	static bool isSafeComponent(const std::string& component) {
+		// Windows silently strips trailing dots and spaces, so "..." or ".. " would become ".."
+		if (component.back() == '.' || component.back() == ' ') {
+			return false;
+		}
+
+		// Reserved device names are reserved with any extension too, e.g. "NUL.txt"
+		std::string base = component.substr(0, component.find('.'));
+		for (char& c : base) {
+			c = static_cast<char>(toupper(static_cast<unsigned char>(c)));
+		}
+		if (base == "CON" || base == "PRN" || base == "AUX" || base == "NUL") {
+			return false;
+		}
+		if (base.size() == 4 && (base.compare(0, 3, "COM") == 0 || base.compare(0, 3, "LPT") == 0) &&
+			base[3] >= '1' && base[3] <= '9') {
+			return false;
+		}
+		return true;
+	}
+
+	bool isKnownMissing(const std::string& relative) {
+		std::lock_guard<std::mutex> lock(m_mu);
+		auto it = m_missing.find(relative);
+		return it != m_missing.end() && it->second > GetTickCount64();
+	}
+
+	void rememberMissing(const std::string& relative) {
+		ULONGLONG expiry = GetTickCount64() + m_missingTtlMs;
+		std::lock_guard<std::mutex> lock(m_mu);
+		auto it = m_missing.find(relative);
+		if (it != m_missing.end()) {
+			it->second = expiry;
+			return;
+		}
+		// Evict the oldest entry once the cache is full so a flood of unique names can't grow it forever
+		if (m_missing.size() >= m_maxCachedEntries && !m_missingOrder.empty()) {
+			m_missing.erase(m_missingOrder.front());
+			m_missingOrder.pop_front();
+		}
+		m_missing.emplace(relative, expiry);
+		m_missingOrder.push_back(relative);
+	}
+
+	// The path handle really refers to, in the same form as GetFullPathName's, or empty if it can't be found out
+	static std::string finalPath(HANDLE handle) {
+		char path[MAX_PATH + 8];
+		DWORD len = GetFinalPathNameByHandleA(handle, path, sizeof(path), FILE_NAME_NORMALIZED | VOLUME_NAME_DOS);
+		if (len == 0 || len >= sizeof(path)) {
+			return "";
+		}
+		std::string result(path, len);
+		// Strip the \\?\ prefix, and turn \\?\UNC\server\share back into \\server\share
+		if (result.compare(0, 8, "\\\\?\\UNC\\") == 0) {
+			return "\\" + result.substr(7);
+		}
+		if (result.compare(0, 4, "\\\\?\\") == 0) {
+			return result.substr(4);
+		}
+		return result;
+	}
+
+	std::string m_root;
+	// m_root with any junctions on the way to it followed
+	std::string m_finalRoot;
+	size_t m_maxCachedEntries;
+	ULONGLONG m_missingTtlMs;
+
+	// mutex for the cache below
+	std::mutex m_mu;
+	// relative paths known not to exist, mapped to when that knowledge expires
+	std::unordered_map<std::string, ULONGLONG> m_missing;
+	// insertion order of m_missing, used to evict the oldest entry
+	std::deque<std::string> m_missingOrder;
+};
@@ -0,0 +1,51 @@
+#pragma once
+#include <WS2tcpip.h>
+#include <bcrypt.h>
+
+#include <climits>
+#include <string>
+
+#pragma comment (lib, "bcrypt.lib")
+
+// SHA-256 through Windows CNG, which uses the SHA extensions or AVX2 when the CPU has them.
+class Sha256
+{
+public:
+	Sha256() : m_hash(nullptr) {
+		BCryptCreateHash(BCRYPT_SHA256_ALG_HANDLE, &m_hash, nullptr, 0, nullptr, 0, 0);
+	}
+
+	~Sha256() {
+		if (m_hash != nullptr) {
+			BCryptDestroyHash(m_hash);
+		}
+	}
+
+	Sha256(const Sha256&) = delete;
+	Sha256& operator=(const Sha256&) = delete;
+
+	void update(const char* data, size_t length) {
+		while (length > 0) {
+			ULONG chunk = length > ULONG_MAX ? ULONG_MAX : static_cast<ULONG>(length);
+			BCryptHashData(m_hash, reinterpret_cast<PUCHAR>(const_cast<char*>(data)), chunk, 0);
+			data += chunk;
+			length -= chunk;
+		}
+	}
+
+	// The digest as 64 lowercase hex characters. The hash can't be updated afterwards.
+	std::string hexDigest() {
+		UCHAR digest[32];
+		BCryptFinishHash(m_hash, digest, sizeof(digest), 0);
+		static const char HEX[] = "0123456789abcdef";
+		std::string hex;
+		for (UCHAR byte : digest) {
+			hex += HEX[byte >> 4];
+			hex += HEX[byte & 0xF];
+		}
+		return hex;
+	}
+
+private:
+	BCRYPT_HASH_HANDLE m_hash;
+};
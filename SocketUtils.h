@@ -0,0 +1,31 @@
+#pragma once
+#include <WS2tcpip.h>
+
+#include <climits>
+#include <string>
+
+// send() is allowed to send less than it was given, so keep going until everything is out.
+// Returns false if the socket errored before all of it could be sent.
+inline bool sendAll(SOCKET sock, const char* data, size_t length) {
+	while (length > 0) {
+		int chunk = length > INT_MAX ? INT_MAX : static_cast<int>(length);
+		int sent = send(sock, data, chunk, 0);
+		if (sent == SOCKET_ERROR) {
+			return false;
+		}
+		data += sent;
+		length -= sent;
+	}
+	return true;
+}
+
+inline bool sendAll(SOCKET sock, const std::string& data) {
+	return sendAll(sock, data.data(), data.size());
+}
+
+// Whether sock is connected over a Unix domain socket rather than TCP
+inline bool isUnixSocket(SOCKET sock) {
+	sockaddr_storage address;
+	int addressSize = sizeof(address);
+	return getsockname(sock, (sockaddr*)&address, &addressSize) == 0 && address.ss_family == AF_UNIX;
+}
@@ -10,11 +10,17 @@
 #include <string>
 #include <sstream>
 
+#include "PathResolver.h"
+#include "SocketUtils.h"
+
 #pragma comment (lib, "ws2_32.lib")
 
 // Number of ms to sleep to assist in multithreading as the operations
-// are very fast.
-static constexpr int SLEEPY_TIME = 25;
+// are very fast. Benchmarks build with /DSERVER_SLEEPY_TIME=0 to measure the real thing.
+#ifndef SERVER_SLEEPY_TIME
+#define SERVER_SLEEPY_TIME 25
+#endif
+static constexpr int SLEEPY_TIME = SERVER_SLEEPY_TIME;
 // With SLEEPY_TIME == 25:
 // If MAX_THREADS == 5, the queue is consistently full
 // If MAX_THREADS == 10, the queue is sometimes fully, but usually hovering between 7 and 9 concurrent threads
@@ -36,6 +42,9 @@ static std::queue<SOCKET> socketQueue;
 // mutex for std::cout
 std::mutex coutMu;
 
+// Resolves requested filenames to files beneath the directory the server was started in
+static PathResolver pathResolver;
+
 // get the current total users connected
 int readUserNumber() {
 	std::unique_lock<std::mutex> sharedLock(usersMu);
@@ -92,6 +101,8 @@ void handleConnection(SOCKET clientSocket, int userNumber, int threadNumber) {
 		coutMu.lock();
 		std::cout << "Error in recv(), quitting" << std::endl;
 		coutMu.unlock();
+		closesocket(clientSocket);
+		decrementConcurrentThreads();
 		return;
 	}
 
@@ -99,11 +110,18 @@ void handleConnection(SOCKET clientSocket, int userNumber, int threadNumber) {
 		coutMu.lock();
 		std::cout << "Client disconnected " << std::endl;
 		coutMu.unlock();
+		closesocket(clientSocket);
+		decrementConcurrentThreads();
 		return;
 	}
 
-	// Determine if the requested file exists
-	std::ifstream f(buf);
+	// Resolve the requested name to a file beneath the serving directory, and determine if it exists
+	std::string filePath;
+	PathResolver::Pin pin;
+	std::ifstream f;
+	if (pathResolver.resolve(std::string(buf, byteCount), filePath, pin) == PathResolver::Result::Found) {
+		f.open(filePath);
+	}
 	if (!f.good()) {
 		std::string text = "File doesn't exist!";
 		strcpy_s(buf, text.c_str());
@@ -111,6 +129,8 @@ void handleConnection(SOCKET clientSocket, int userNumber, int threadNumber) {
 		// tell the client the file doesn't exist and close the socket
 		send(clientSocket, buf, byteCount, 0);
 		closesocket(clientSocket);
+		// Early returns have to give back their concurrent thread too, or the count creeps up forever
+		decrementConcurrentThreads();
 		return;
 	}
 
@@ -120,10 +140,6 @@ void handleConnection(SOCKET clientSocket, int userNumber, int threadNumber) {
 	std::string outText = ss_buf.str();
 	f.close();
 
-	// Send the contents of the file back to the client
-	strcpy_s(buf, outText.c_str());
-	byteCount = strlen(outText.c_str());
-
 	coutMu.lock();
 	std::cout << "User number " << userNumber << " on thread " << threadNumber << " is sending message" << std::endl;
 	coutMu.unlock();
@@ -131,7 +147,8 @@ void handleConnection(SOCKET clientSocket, int userNumber, int threadNumber) {
 	// A pause just so we can get more concurrent threads, this operation
 	// is so quick that usually there aren't more than 1 or 2 concurrent threads naturally.
 	Sleep(SLEEPY_TIME);
-	send(clientSocket, buf, byteCount, 0);
+	// Send the contents of the file back to the client. Files can be much larger than buf, so send it straight from the string
+	sendAll(clientSocket, outText);
 	closesocket(clientSocket);
 
 	int concurrentThreadsNow = readConcurrentThreads();
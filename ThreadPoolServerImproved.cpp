@@ -11,13 +11,22 @@
 #include <string>
 #include <sstream>
 
+#include "FileCache.h"
+#include "FileMappings.h"
+#include "Job.h"
+#include "PathResolver.h"
+#include "SocketUtils.h"
 #include "ThreadPoolVars.h"
+#include "TlsChannel.h"
 
 #pragma comment (lib, "ws2_32.lib")
 
 // Number of ms to sleep to assist in multithreading as the operations
-// are very fast.
-static constexpr int SLEEPY_TIME = 250;
+// are very fast. Benchmarks build with /DSERVER_SLEEPY_TIME=0 to measure the real thing.
+#ifndef SERVER_SLEEPY_TIME
+#define SERVER_SLEEPY_TIME 250
+#endif
+static constexpr int SLEEPY_TIME = SERVER_SLEEPY_TIME;
 // With SLEEPY_TIME == 25:
 // If MAX_THREADS == 5, the queue is consistently full
 // If MAX_THREADS == 10, the queue is sometimes fully, but usually hovering between 7 and 9 concurrent threads
@@ -32,91 +41,478 @@ static int totalUsersConnected = 0;
 std::mutex concThreadsMu;
 static int concurrentThreads = 0;
 
-// mutex for the wrapped socket queue
+// Big responses are sent this many bytes at a time. In between, the connection goes back on the queue,
+// so a worker is never tied up by one transfer while small requests wait behind it.
+static constexpr unsigned long long SLICE_BYTES = 256 * 1024;
+
+// mutex for the wrapped job queue
 std::mutex socketMu;
-static std::queue<SOCKET> socketQueue;
+static JobQueue jobQueue;
+static unsigned long long jobsQueued = 0;
 // We use a condition variable to notify threads when the queue has been added to
 // instead of the threads constantly checking whether the queue is empty or not, which
 // consumes a lot of CPU
 std::condition_variable  socketCV;
 
+// Resolves requested filenames to files beneath the directory the server was started in
+static PathResolver pathResolver;
+
+// Only set when the server was started with --tls
+static std::unique_ptr<TlsCredentials> tlsCredentials;
+
+// Contents and digests of recently requested files
+static FileCache fileCache;
+
+// Shared memory copies of files handed to clients on the Unix domain socket
+static FileMappings fileMappings;
+
+// Clients on this machine can connect here instead of going through the TCP stack.
+// Relative to the directory the server was started in.
+static const std::string UNIX_SOCKET_PATH = "MultithreadServer.sock";
+
+// Files up to this size are sent in the same send() as the response line, so Nagle's algorithm
+// doesn't hold the file back waiting for the response line to be acknowledged
+static constexpr size_t COALESCE_BYTES = 64 * 1024;
+
+// How long a connection can wait for its next request before the server closes it. Waiting doesn't hold a
+// worker, pollRequests() watches the connection until the request arrives.
+static constexpr DWORD KEEP_ALIVE_MS = 2000;
+
+// Longest a worker spends in one recv() on a connection that was readable. Plenty for the rest of a TLS record
+// from a client on any working network.
+static constexpr DWORD RECV_TIME_LIMIT_MS = 500;
+
+// mutex for connections handed to pollRequests() that it hasn't picked up yet
+std::mutex pollMu;
+static std::vector<std::shared_ptr<Job>> pollAdded;
+// pollRequests() sleeps in WSAPoll, which only waits on sockets. Workers wake it up by sending a datagram
+// to a UDP socket bound to loopback that it polls along with the connections.
+static SOCKET pollWakeSocket = INVALID_SOCKET;
+static sockaddr_in pollWakeAddress;
+
+/*
+ * Besides the original protocol, where the client sends a bare filename and gets the file back, a client can
+ * ask for a file along with its digest, and ask for it only if it has changed. Each request is one line:
+ *
+ *   GET <digest, or - if the client doesn't have the file> <filename>\n
+ *
+ * and is answered with one of
+ *
+ *   OK <digest> <length>\n followed by length bytes of the file
+ *   SAME <digest>\n when the client already has this version of the file
+ *   MISSING\n
+ *
+ * Clients connected over the Unix domain socket can send MAP instead of GET, with the same arguments. Instead of
+ * the file they get
+ *
+ *   MAPPED <digest> <length> <handle>\n
+ *
+ * where handle is a read-only handle to a section holding the file, already duplicated into the client's
+ * process and owned by it. If the line can't be sent the handle is closed again in the client, but a client
+ * that hangs up before reading it keeps the handle until it exits. If the file can't be shared that way, or the client isn't local, MAP is
+ * answered just like GET.
+ *
+ * The digest is the SHA-256 of the file's bytes in lowercase hex. The connection stays open after a digest
+ * request, so a client can send more of them, without waiting for the answers if it likes (pipelining).
+ * They're answered in order, and the server closes the connection once it has been idle for KEEP_ALIVE_MS.
+ */
+static bool isDigestRequest(const std::string& request) {
+	return request.compare(0, 4, "GET ") == 0 || request.compare(0, 4, "MAP ") == 0;
+}
 
-// Function that handles the connection once popped from the queue
-void handleConnection(SOCKET clientSocket, int userNumber, int threadNumber, std::shared_ptr<ThreadPoolVars> threadVars) {
-	threadVars->incrementConcurrentThreads();
-	std::string coutStr = "User number " + std::to_string(userNumber) + " on thread " + std::to_string(threadNumber) + " has connected.";
-	threadVars->print(coutStr);
+// Work out the response to one digest request line and leave it on the job to be sent
+static void prepareDigestResponse(Job& job, const std::string& request) {
+	size_t lineEnd = request.find('\n');
+	size_t digestEnd = request.find(' ', 4);
+	if (!isDigestRequest(request) || lineEnd == std::string::npos || digestEnd == std::string::npos || digestEnd > lineEnd) {
+		job.pending = "MISSING\n";
+		return;
+	}
+	std::string knownDigest = request.substr(4, digestEnd - 4);
+	std::string name = request.substr(digestEnd + 1, lineEnd - digestEnd - 1);
+	if (!name.empty() && name.back() == '\r') {
+		name.pop_back();
+	}
+
+	std::string filePath;
+	PathResolver::Pin pin;
+	FileCache::Entry entry;
+	if (pathResolver.resolve(name, filePath, pin) != PathResolver::Result::Found || !fileCache.lookup(filePath, entry)) {
+		job.pending = "MISSING\n";
+		return;
+	}
+
+	// The client already has this exact file, so all it needs is confirmation
+	if (knownDigest == entry.digest) {
+		job.pending = "SAME " + entry.digest + "\n";
+		return;
+	}
+
+	// A local client can map the file instead of having it copied through the socket
+	unsigned long long remoteHandle = 0;
+	if (job.local && request.compare(0, 4, "MAP ") == 0) {
+		FileMappings::Section section = fileMappings.get(filePath, entry);
+		if (section && !job.peer) {
+			job.peer = FileMappings::peerOf(job.clientSocket);
+		}
+		if (section && job.peer && FileMappings::shareWith(job.peer, section, remoteHandle)) {
+			job.sharedHandle = remoteHandle;
+			job.pending = "MAPPED " + entry.digest + " " + std::to_string(entry.size) + " " + std::to_string(remoteHandle) + "\n";
+			return;
+		}
+	}
+
+	std::string header = "OK " + entry.digest + " " + std::to_string(entry.size) + "\n";
+	if (entry.contents && entry.contents->size() <= COALESCE_BYTES) {
+		job.pending = header + *entry.contents;
+	}
+	else if (entry.contents) {
+		job.pending = header;
+		job.contents = entry.contents;
+	}
+	else {
+		// Too big to cache, stream it from disk. Never send more than the length we promised.
+		job.pending = header;
+		job.file.reset(new std::ifstream(filePath, std::ios::binary));
+		job.fileRemaining = entry.size;
+		job.fileHash.reset(new Sha256());
+		job.fileDigest = entry.digest;
+	}
+}
+
+// Work out the response to a bare filename and leave it on the job to be sent
+static void prepareFileResponse(Job& job, const std::string& request) {
+	// Resolve the requested name to a file beneath the serving directory, and determine if it exists.
+	// Its size on disk tells the scheduler how big the response is going to be.
+	std::string filePath;
+	PathResolver::Pin pin;
+	WIN32_FILE_ATTRIBUTE_DATA attributes;
+	std::unique_ptr<std::ifstream> f(new std::ifstream);
+	if (pathResolver.resolve(request, filePath, pin) == PathResolver::Result::Found &&
+		GetFileAttributesExA(filePath.c_str(), GetFileExInfoStandard, &attributes)) {
+		f->open(filePath);
+	}
+	if (!f->good()) {
+		// tell the client the file doesn't exist, the connection is closed once that's sent
+		job.pending = "File doesn't exist!";
+		return;
+	}
+
+	// The file is opened in text mode like it always has been, so fewer bytes than this may come out of it.
+	// Sending stops at the end of the file either way.
+	job.file = std::move(f);
+	job.fileRemaining = (static_cast<unsigned long long>(attributes.nFileSizeHigh) << 32) | attributes.nFileSizeLow;
+}
+
+// Read what the client has sent, and once there's a whole request, work out the response. Only called once the
+// socket is readable, or the request is already buffered, so it doesn't sit in recv() while the client is quiet.
+// On a new connection it only sends the prompt. Returns false if the connection should be closed instead.
+static bool readRequest(Job& job, int threadNumber, std::shared_ptr<ThreadPoolVars> threadVars) {
+	std::string coutStr;
+	if (!job.started) {
+		coutStr = "User number " + std::to_string(job.userNumber) + " on thread " + std::to_string(threadNumber) + " has connected.";
+		threadVars->print(coutStr);
+
+		// With TLS turned on, the handshake happens before anything else is said. Without it the channel is plain TCP.
+		// Connections on the Unix domain socket never leave this machine, so they skip TLS, which FileClient doesn't speak.
+		job.local = isUnixSocket(job.clientSocket);
+		job.channel.reset(new TlsChannel(job.clientSocket));
+		if (tlsCredentials && !job.local && !job.channel->accept(*tlsCredentials)) {
+			coutStr = "User number " + std::to_string(job.userNumber) + " on thread " + std::to_string(threadNumber) + " failed the TLS handshake.";
+			threadVars->print(coutStr);
+			return false;
+		}
 
-	// tell the user to request a file
-	std::string reqString = "Please request a file: ";
-	send(clientSocket, reqString.c_str(), strlen(reqString.c_str()), 0);
+		// The worker only reads once the socket is readable, but the rest of a TLS record can still be trickled in
+		// after that. A client that takes longer than this over one read loses its connection rather than its worker.
+		job.channel->setRecvTimeLimit(RECV_TIME_LIMIT_MS);
+
+		// tell the user to request a file, and wait for it without holding the worker
+		job.channel->send("Please request a file: ");
+		job.started = true;
+		return true;
+	}
 
 	const int BUFSIZE = 4096;
 	char buf[BUFSIZE];
-	ZeroMemory(buf, BUFSIZE);
 
-	// Receive a message from the client
-	int byteCount = recv(clientSocket, buf, BUFSIZE, 0);
+	// A pipelining client may have sent its next request along with the last one
+	if (job.request.find('\n') == std::string::npos) {
+		// Receive a message from the client
+		int byteCount = job.channel->recv(buf, BUFSIZE);
+
+		if (byteCount == SOCKET_ERROR) {
+			// A client closing a digest connection without a word isn't worth reporting
+			if (!job.keepAlive) {
+				coutStr = "Error in recv(), quitting";
+				threadVars->print(coutStr);
+			}
+			return false;
+		}
 
-	coutStr = "User number " + std::to_string(userNumber) + " on thread " + std::to_string(threadNumber) + " received message.";
-	threadVars->print(coutStr);
+		if (byteCount == 0) {
+			coutStr = "Client disconnected ";
+			threadVars->print(coutStr);
+			return false;
+		}
 
-	if (byteCount == SOCKET_ERROR) {
-		coutStr = "Error in recv(), quitting";
+		coutStr = "User number " + std::to_string(job.userNumber) + " on thread " + std::to_string(threadNumber) + " received message.";
 		threadVars->print(coutStr);
-		return;
+		job.request.append(buf, byteCount);
 	}
 
-	if (byteCount == 0) {
-		coutStr = "Client disconnected ";
+	// Keep answering requests on a digest connection until the client closes it or goes quiet
+	job.keepAlive = job.keepAlive || isDigestRequest(job.request);
+
+	if (job.keepAlive) {
+		// Each request is a whole line, which may not have arrived in one piece. Wait for the rest of it
+		// the same way as for a new request, unless the line is already too long to be one.
+		size_t lineEnd = job.request.find('\n');
+		if (lineEnd == std::string::npos) {
+			return job.request.size() < BUFSIZE;
+		}
+
+		coutStr = "User number " + std::to_string(job.userNumber) + " on thread " + std::to_string(threadNumber) + " is answering a digest request.";
 		threadVars->print(coutStr);
-		return;
+
+		Sleep(SLEEPY_TIME);
+		prepareDigestResponse(job, job.request.substr(0, lineEnd + 1));
+		job.request.erase(0, lineEnd + 1);
+	}
+	else {
+		prepareFileResponse(job, job.request);
+		job.request.clear();
+		if (job.file) {
+			coutStr = "User number " + std::to_string(job.userNumber) + " on thread " + std::to_string(threadNumber) + " is sending message.";
+			threadVars->print(coutStr);
+			// A pause just so we can get more concurrent threads, this operation
+			// is so quick that usually there aren't more than 1 or 2 concurrent threads naturally.
+			Sleep(SLEEPY_TIME);
+		}
 	}
 
-	// Determine if the requested file exists
-	std::ifstream f(buf);
-	if (!f.good()) {
-		std::string text = "File doesn't exist!";
-		strcpy_s(buf, text.c_str());
-		byteCount = strlen(text.c_str());
-		// tell the client the file doesn't exist and close the socket
-		send(clientSocket, buf, byteCount, 0);
-		closesocket(clientSocket);
-		return;
+	job.responding = true;
+	job.readyAt = GetTickCount64();
+	return true;
+}
+
+// Send at most SLICE_BYTES more of the job's response.
+// Returns false if the connection should be closed, either because sending failed or because there's nothing more to do.
+static bool sendSlice(Job& job) {
+	unsigned long long budget = SLICE_BYTES;
+	if (!job.pending.empty()) {
+		if (!job.channel->send(job.pending)) {
+			// The client never heard about the handle we put in its process, so it would never close it
+			if (job.sharedHandle != 0) {
+				FileMappings::revoke(job.peer, job.sharedHandle);
+			}
+			return false;
+		}
+		job.sharedHandle = 0;
+		budget -= job.pending.size() < budget ? job.pending.size() : budget;
+		job.pending.clear();
 	}
 
-	// write the contents of the file to stringstream, and then a string
-	std::ostringstream ss_buf;
-	ss_buf << f.rdbuf();
-	std::string outText = ss_buf.str();
-	f.close();
+	if (job.contents && budget > 0) {
+		size_t left = job.contents->size() - job.contentsOffset;
+		size_t count = left < budget ? left : static_cast<size_t>(budget);
+		if (!job.channel->send(job.contents->data() + job.contentsOffset, count)) {
+			return false;
+		}
+		job.contentsOffset += count;
+		budget -= count;
+		if (job.contentsOffset == job.contents->size()) {
+			job.contents.reset();
+			job.contentsOffset = 0;
+		}
+	}
 
-	// Send the contents of the file back to the client
-	strcpy_s(buf, outText.c_str());
-	byteCount = strlen(outText.c_str());
+	if (job.file && budget > 0) {
+		unsigned long long count = job.fileRemaining < budget ? job.fileRemaining : budget;
+		// Stream the contents of the file back to the client. Over TLS every chunk is read straight into
+		// the record buffer and encrypted in place, so the file is never copied into a string first.
+		// When the file's digest has already been sent, it can change on disk before the last slice goes out,
+		// so it's hashed again on the way, and the last piece is only sent if the hash still matches.
+		// Otherwise the connection is closed and the client is left short of the length it was promised,
+		// instead of being handed bytes that don't match the digest.
+		bool last = count == job.fileRemaining;
+		if (!job.channel->sendStream(*job.file, count, job.fileHash.get(), job.fileHash && last ? &job.fileDigest : nullptr)) {
+			return false;
+		}
+		job.fileRemaining -= count;
+		// A file we promised a length for can't end early
+		if (job.fileHash && job.fileRemaining > 0 && job.file->eof()) {
+			return false;
+		}
+		if (job.fileRemaining == 0 || job.file->eof()) {
+			job.file.reset();
+			job.fileHash.reset();
+			job.fileRemaining = 0;
+		}
+	}
 
-	coutStr = "User number " + std::to_string(userNumber) + " on thread " + std::to_string(threadNumber) + " is sending message.";
-	threadVars->print(coutStr);
+	if (job.remaining() > 0) {
+		return true;
+	}
+	// The whole response is out. Only a digest connection has anything more to do.
+	job.responding = false;
+	job.readyAt = GetTickCount64();
+	return job.keepAlive;
+}
 
-	// A pause just so we can get more concurrent threads, this operation
-	// is so quick that usually there aren't more than 1 or 2 concurrent threads naturally.
-	Sleep(SLEEPY_TIME);
-	send(clientSocket, buf, byteCount, 0);
-	closesocket(clientSocket);
+// Put a job on the queue, ahead of the jobs with more left to send than it, allowing for how long each has waited,
+// and wake up a worker to handle it. Returns the size of the queue after pushing.
+static size_t scheduleJob(const std::shared_ptr<Job>& job) {
+	job->prioritize();
+	size_t queueSize;
+	{
+		std::lock_guard<std::mutex> socketLock(socketMu);
+		job->sequence = jobsQueued++;
+		jobQueue.push(job);
+		queueSize = jobQueue.size();
+	}
+	socketCV.notify_one();
+	return queueSize;
+}
+
+// Hand a connection to pollRequests() until its next request arrives
+static void waitForRequest(const std::shared_ptr<Job>& job) {
+	job->readyAt = GetTickCount64();
+	{
+		std::lock_guard<std::mutex> pollLock(pollMu);
+		pollAdded.push_back(job);
+	}
+	char byte = 0;
+	sendto(pollWakeSocket, &byte, 1, 0, (sockaddr*)&pollWakeAddress, sizeof(pollWakeAddress));
+}
+
+// Watch the connections that are waiting for a request, and put each one on the queue as soon as it has something
+// to read. Until then they don't hold a worker, so quiet keep-alive connections and slow clients can't park
+// every worker in recv() while small requests queue up. Connections that wait longer than KEEP_ALIVE_MS are closed.
+void pollRequests(std::shared_ptr<ThreadPoolVars> threadVars) {
+	std::vector<std::shared_ptr<Job>> waiting;
+	while (true) {
+		{
+			std::lock_guard<std::mutex> pollLock(pollMu);
+			waiting.insert(waiting.end(), pollAdded.begin(), pollAdded.end());
+			pollAdded.clear();
+		}
+
+		// Sleep until something arrives, or the next connection runs out of time
+		ULONGLONG now = GetTickCount64();
+		ULONGLONG nextExpiry = now + KEEP_ALIVE_MS;
+		std::vector<WSAPOLLFD> fds(1 + waiting.size());
+		fds[0].fd = pollWakeSocket;
+		fds[0].events = POLLRDNORM;
+		for (size_t i = 0; i < waiting.size(); i++) {
+			fds[i + 1].fd = waiting[i]->clientSocket;
+			fds[i + 1].events = POLLRDNORM;
+			if (waiting[i]->readyAt + KEEP_ALIVE_MS < nextExpiry) {
+				nextExpiry = waiting[i]->readyAt + KEEP_ALIVE_MS;
+			}
+		}
+		WSAPoll(fds.data(), static_cast<ULONG>(fds.size()), nextExpiry > now ? static_cast<int>(nextExpiry - now) : 0);
+
+		if (fds[0].revents & POLLRDNORM) {
+			char drain[64];
+			while (recv(pollWakeSocket, drain, sizeof(drain), 0) > 0) {}
+		}
+
+		now = GetTickCount64();
+		std::vector<std::shared_ptr<Job>> stillWaiting;
+		for (size_t i = 0; i < waiting.size(); i++) {
+			std::shared_ptr<Job>& job = waiting[i];
+			// A closed or broken connection counts as readable too, and the worker finds out when it reads
+			if (fds[i + 1].revents != 0) {
+				job->readyAt = now;
+				scheduleJob(job);
+			}
+			else if (now - job->readyAt >= KEEP_ALIVE_MS) {
+				if (job->channel) {
+					job->channel->shutdown();
+				}
+				closesocket(job->clientSocket);
+				std::string coutStr = "User number " + std::to_string(job->userNumber) + " went quiet, closing the connection.";
+				threadVars->print(coutStr);
+			}
+			else {
+				stillWaiting.push_back(job);
+			}
+		}
+		waiting.swap(stillWaiting);
+	}
+}
+
+// Function that does the next piece of work on a connection once popped from the queue: reading its next request,
+// or sending the next slice of a response. The connection goes back on the queue if there's more to do.
+void handleConnection(std::shared_ptr<Job> job, int threadNumber, std::shared_ptr<ThreadPoolVars> threadVars) {
+	threadVars->incrementConcurrentThreads();
+	bool more = job->responding ? sendSlice(*job) : readRequest(*job, threadNumber, threadVars);
 
 	int concurrentThreadsNow = threadVars->readConcurrentThreads();
 	if (concurrentThreadsNow > MAX_THREADS) {
 		throw std::runtime_error("Error! concurrent threads exceeds MAX_THREADS, something has gone wrong!");
 	}
 
-	coutStr = "User number " + std::to_string(userNumber) + " on thread " + std::to_string(threadNumber) + " is sending message.\nConcurrent threads: " +
+	if (more) {
+		threadVars->decrementConcurrentThreads();
+		// A pipelining client may have sent its next request along with the last one, otherwise wait for it
+		if (job->responding || job->request.find('\n') != std::string::npos || job->channel->hasBuffered()) {
+			scheduleJob(job);
+		}
+		else {
+			waitForRequest(job);
+		}
+		return;
+	}
+
+	if (job->channel) {
+		job->channel->shutdown();
+	}
+	closesocket(job->clientSocket);
+
+	std::string coutStr = "User number " + std::to_string(job->userNumber) + " on thread " + std::to_string(threadNumber) + " is done.\nConcurrent threads: " +
 		std::to_string(concurrentThreadsNow) + "\n<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<< Ending handleConnection on thread " +
 		std::to_string(threadNumber);
 	threadVars->print(coutStr);
-	// Thread is dying, decrement the counter of concurrent threads.
+	// Connection is done, decrement the counter of concurrent threads.
 	threadVars->decrementConcurrentThreads();
 }
 
+// Push an accepted connection onto the queue and wake up a worker to handle it
+void queueConnection(SOCKET clientSocket, std::shared_ptr<ThreadPoolVars> threadVars) {
+	std::string coutStr = "pushing to queue";
+	threadVars->print(coutStr);
+	std::shared_ptr<Job> job = std::make_shared<Job>();
+	job->clientSocket = clientSocket;
+	job->readyAt = GetTickCount64();
+	// A TLS client speaks first, so the connection isn't worth a worker's time until the handshake starts
+	if (tlsCredentials && !isUnixSocket(clientSocket)) {
+		waitForRequest(job);
+		coutStr = "waiting for the TLS handshake before queueing";
+		threadVars->print(coutStr);
+		return;
+	}
+	coutStr = "pushed to queue. Queue size: " + std::to_string(scheduleJob(job));
+	threadVars->print(coutStr);
+}
+
+// Accept connections on the Unix domain socket. They go on the same queue as the TCP ones.
+void acceptLocal(SOCKET localListening, std::shared_ptr<ThreadPoolVars> threadVars) {
+	while (true) {
+		SOCKET clientSocket = accept(localListening, nullptr, nullptr);
+		if (clientSocket == INVALID_SOCKET) {
+			std::string coutStr = "Can't accept on " + UNIX_SOCKET_PATH + ", no longer listening there";
+			threadVars->print(coutStr);
+			closesocket(localListening);
+			return;
+		}
+		std::string coutStr = "Local client connected on " + UNIX_SOCKET_PATH;
+		threadVars->print(coutStr);
+		queueConnection(clientSocket, threadVars);
+	}
+}
+
 void handleQueue(int threadNumber, std::shared_ptr<ThreadPoolVars> threadVars) {
 	while (true) {
 		/*
@@ -127,28 +523,30 @@ void handleQueue(int threadNumber, std::shared_ptr<ThreadPoolVars> threadVars) {
 		std::unique_lock<std::mutex> socketLock(socketMu);
 		// We wait for something to push to the queue. We add the predicate as a sanity check to ensure
 		// the queue is not empty, as sometimes conditional waits can errorneously pass without a predicate.
-		socketCV.wait(socketLock, [] { return !socketQueue.empty(); });
-		// Thread begins
-		SOCKET client = socketQueue.front(); // Get the client socket
-		socketQueue.pop();
-		std::string queuePopString = "Popping from queue, queue size: " + std::to_string(socketQueue.size());
+		socketCV.wait(socketLock, [] { return !jobQueue.empty(); });
+		// Thread begins. Rather than first come first served, take the job closest to being done,
+		// so small requests don't queue up behind big transfers.
+		std::shared_ptr<Job> job = jobQueue.top();
+		jobQueue.pop();
+		std::string queuePopString = "Popping from queue, queue size: " + std::to_string(jobQueue.size());
 		threadVars->print(queuePopString);
 		socketLock.unlock();
 		// We pop from the queue, and notify a waiting thread to check if the queue is empty, as this thread is
 		// done with access to the queue.
 		socketCV.notify_one();
 
-
-		// increment the total users that have connected to the server
-		threadVars->incrementUsersConnected();
-		int userNumber = threadVars->readUsersConnected();
-		std::string threadStartString = ">>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>> Starting handleConnection on thread  " + std::to_string(threadNumber);
-		threadVars->print(threadStartString);
-		handleConnection(client, userNumber, threadNumber, threadVars); // let this function handle it now.
+		if (!job->started) {
+			// increment the total users that have connected to the server
+			threadVars->incrementUsersConnected();
+			job->userNumber = threadVars->readUsersConnected();
+			std::string threadStartString = ">>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>> Starting handleConnection on thread  " + std::to_string(threadNumber);
+			threadVars->print(threadStartString);
+		}
+		handleConnection(job, threadNumber, threadVars); // let this function handle it now.
 	}
 }
 
-int main() {
+int main(int argc, char* argv[]) {
 	// initialize winsock
 	WSADATA wsData;
 	WORD ver = MAKEWORD(2, 2);
@@ -159,6 +557,17 @@ int main() {
 		return 0;
 	}
 
+	// Optionally encrypt every connection: ThreadPoolServerImproved.exe --tls <certificate subject>
+	if (argc == 3 && std::string(argv[1]) == "--tls") {
+		tlsCredentials = TlsCredentials::forServer(argv[2]);
+		if (!tlsCredentials) {
+			std::cerr << "Can't load a TLS certificate for " << argv[2] << ", quitting" << std::endl;
+			WSACleanup();
+			return 0;
+		}
+		std::cout << "TLS enabled with certificate " << argv[2] << std::endl;
+	}
+
 	// create a socket
 	// SOCK_STREAM is TCP socket
 	SOCKET listening = socket(AF_INET, SOCK_STREAM, 0);
@@ -189,6 +598,54 @@ int main() {
 		threads.emplace_back(std::thread(handleQueue, i + 1, threadVars));
 	}
 
+	// Connections waiting for a request are watched by their own thread instead of a worker
+	pollWakeSocket = socket(AF_INET, SOCK_DGRAM, 0);
+	ZeroMemory(&pollWakeAddress, sizeof(pollWakeAddress));
+	pollWakeAddress.sin_family = AF_INET;
+	inet_pton(AF_INET, "127.0.0.1", &pollWakeAddress.sin_addr);
+	bind(pollWakeSocket, (sockaddr*)&pollWakeAddress, sizeof(pollWakeAddress));
+	int wakeAddressSize = sizeof(pollWakeAddress);
+	getsockname(pollWakeSocket, (sockaddr*)&pollWakeAddress, &wakeAddressSize);
+	u_long nonBlocking = 1;
+	ioctlsocket(pollWakeSocket, FIONBIO, &nonBlocking);
+	std::thread(pollRequests, threadVars).detach();
+
+	// Also listen on a Unix domain socket, so clients on this machine can skip the TCP stack altogether.
+	// This needs Windows 10 1803 or later, and the server carries on with only TCP without it.
+	SOCKET localListening = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (localListening != INVALID_SOCKET) {
+		SOCKADDR_UN localHint;
+		ZeroMemory(&localHint, sizeof(localHint));
+		localHint.sun_family = AF_UNIX;
+		strcpy_s(localHint.sun_path, UNIX_SOCKET_PATH.c_str());
+		// A socket file left behind by an earlier run would make bind() fail, but deleting the file of a server that's
+		// still running would quietly take its local clients over. Only a stale file refuses connections.
+		SOCKET probe = socket(AF_UNIX, SOCK_STREAM, 0);
+		bool inUse = probe != INVALID_SOCKET && connect(probe, (sockaddr*)&localHint, sizeof(localHint)) == 0;
+		if (probe != INVALID_SOCKET) {
+			closesocket(probe);
+		}
+		if (inUse) {
+			std::cerr << "Another server is already listening on " << UNIX_SOCKET_PATH << std::endl;
+			closesocket(localListening);
+			localListening = INVALID_SOCKET;
+		}
+		else {
+			DeleteFileA(UNIX_SOCKET_PATH.c_str());
+			if (bind(localListening, (sockaddr*)&localHint, sizeof(localHint)) == SOCKET_ERROR || listen(localListening, SOMAXCONN) == SOCKET_ERROR) {
+				closesocket(localListening);
+				localListening = INVALID_SOCKET;
+			}
+		}
+	}
+	if (localListening == INVALID_SOCKET) {
+		std::cerr << "Can't listen on " << UNIX_SOCKET_PATH << ", only listening on TCP" << std::endl;
+	}
+	else {
+		std::cout << "Listening for local connections on " << UNIX_SOCKET_PATH << std::endl;
+		std::thread(acceptLocal, localListening, threadVars).detach();
+	}
+
 	while (true) {
 		// wait for connection
 		sockaddr_in client;
@@ -219,17 +676,7 @@ int main() {
 			threadVars->print(coutStr);
 		}
 		// we got a connection, insert into thread pool
-
-		coutStr = "pushing to queue";
-		threadVars->print(coutStr);
-		{
-			std::lock_guard<std::mutex> socketLock(socketMu);
-			socketQueue.push(clientSocket);
-			coutStr = "pushed to queue. Queue size: " + std::to_string(socketQueue.size());
-			threadVars->print(coutStr);
-
-		}
-		socketCV.notify_one();
+		queueConnection(clientSocket, threadVars);
 	}
 
 	// close listening socket
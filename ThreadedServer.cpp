@@ -7,8 +7,18 @@
 #include <string>
 #include <sstream>
 
+#include "PathResolver.h"
+#include "SocketUtils.h"
+
 #pragma comment (lib, "ws2_32.lib")
 
+// Number of ms to sleep to assist in multithreading as the operations
+// are very fast. Benchmarks build with /DSERVER_SLEEPY_TIME=0 to measure the real thing.
+#ifndef SERVER_SLEEPY_TIME
+#define SERVER_SLEEPY_TIME 25
+#endif
+static constexpr int SLEEPY_TIME = SERVER_SLEEPY_TIME;
+
 // mutex for increment/decrement concurrentThreads
 std::mutex threadMu;
 static int concurrentThreads = 0;
@@ -16,6 +26,9 @@ static int concurrentThreads = 0;
 // Used to lock std::cout for pretty printing to console
 std::mutex coutMu;
 
+// Resolves requested filenames to files beneath the directory the server was started in
+static PathResolver pathResolver;
+
 void handleConnection(SOCKET clientSocket, int i) {
 	threadMu.lock();
 	concurrentThreads++;
@@ -39,6 +52,10 @@ void handleConnection(SOCKET clientSocket, int i) {
 		coutMu.lock();
 		std::cout << "Error in recv(), quitting" << std::endl;
 		coutMu.unlock();
+		closesocket(clientSocket);
+		threadMu.lock();
+		concurrentThreads--;
+		threadMu.unlock();
 		return;
 	}
 
@@ -46,11 +63,20 @@ void handleConnection(SOCKET clientSocket, int i) {
 		coutMu.lock();
 		std::cout << "Client disconnected " << std::endl;
 		coutMu.unlock();
+		closesocket(clientSocket);
+		threadMu.lock();
+		concurrentThreads--;
+		threadMu.unlock();
 		return;
 	}
 
-	// Determine if the requested file exists
-	std::ifstream f(buf);
+	// Resolve the requested name to a file beneath the serving directory, and determine if it exists
+	std::string filePath;
+	PathResolver::Pin pin;
+	std::ifstream f;
+	if (pathResolver.resolve(std::string(buf, byteCount), filePath, pin) == PathResolver::Result::Found) {
+		f.open(filePath);
+	}
 	if (!f.good()) {
 		std::string text = "File doesn't exist!";
 		strcpy_s(buf, text.c_str());
@@ -58,6 +84,10 @@ void handleConnection(SOCKET clientSocket, int i) {
 		// tell the client the file doesn't exist and close the socket
 		send(clientSocket, buf, byteCount, 0);
 		closesocket(clientSocket);
+		// Early returns have to give back their concurrent thread too, or the count creeps up forever
+		threadMu.lock();
+		concurrentThreads--;
+		threadMu.unlock();
 		return;
 	}
 
@@ -66,10 +96,6 @@ void handleConnection(SOCKET clientSocket, int i) {
 	ss_buf << f.rdbuf();
 	std::string outText = ss_buf.str();
 
-	// Send the contents of the file back to the client
-	strcpy_s(buf, outText.c_str());
-	byteCount = strlen(outText.c_str());
-
 	coutMu.lock();
 	std::cout << "Thread " << i << "sending message" << std::endl;
 	coutMu.unlock();
@@ -77,8 +103,9 @@ void handleConnection(SOCKET clientSocket, int i) {
 	// A pause just so we can get more concurrent threads, this operation
 	// is so quick that usually there aren't more than 1 or 2 concurrent threads.
 	// Sleeping 25ms usually gives around 13-15 concurrent threads at a time
-	Sleep(25);
-	send(clientSocket, buf, byteCount, 0);
+	Sleep(SLEEPY_TIME);
+	// Send the contents of the file back to the client. Files can be much larger than buf, so send it straight from the string
+	sendAll(clientSocket, outText);
 	closesocket(clientSocket);
 	f.close();
 
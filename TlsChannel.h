@@ -0,0 +1,440 @@
+#pragma once
+#include <WS2tcpip.h>
+#include <wincrypt.h>
+
+#define SECURITY_WIN32
+#include <schannel.h>
+#include <security.h>
+
+#include <climits>
+#include <istream>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "Sha256.h"
+#include "SocketUtils.h"
+
+#pragma comment (lib, "crypt32.lib")
+#pragma comment (lib, "secur32.lib")
+
+/*
+ * Schannel credentials, loaded once and shared by every connection.
+ * The server needs a certificate with a private key from the current user's personal store, found by subject.
+ * The client validates the server's certificate against the trusted roots, so a self-signed certificate
+ * has to be trusted first (see the README).
+ */
+class TlsCredentials
+{
+public:
+	~TlsCredentials() {
+		if (m_hasCredentials) {
+			FreeCredentialsHandle(&m_credentials);
+		}
+		if (m_certificate != nullptr) {
+			CertFreeCertificateContext(m_certificate);
+		}
+		if (m_store != nullptr) {
+			CertCloseStore(m_store, 0);
+		}
+	}
+
+	// Returns nullptr if the certificate can't be found or Schannel refuses it
+	static std::unique_ptr<TlsCredentials> forServer(const std::string& subject) {
+		std::unique_ptr<TlsCredentials> creds(new TlsCredentials());
+		creds->m_store = CertOpenStore(CERT_STORE_PROV_SYSTEM_A, 0, 0, CERT_SYSTEM_STORE_CURRENT_USER, "MY");
+		if (creds->m_store == nullptr) {
+			return nullptr;
+		}
+		creds->m_certificate = CertFindCertificateInStore(creds->m_store, X509_ASN_ENCODING, 0,
+			CERT_FIND_SUBJECT_STR_A, subject.c_str(), nullptr);
+		if (creds->m_certificate == nullptr) {
+			return nullptr;
+		}
+
+		SCHANNEL_CRED schannelCred;
+		ZeroMemory(&schannelCred, sizeof(schannelCred));
+		schannelCred.dwVersion = SCHANNEL_CRED_VERSION;
+		schannelCred.cCreds = 1;
+		schannelCred.paCred = &creds->m_certificate;
+		schannelCred.grbitEnabledProtocols = SP_PROT_TLS1_2_SERVER;
+		schannelCred.dwFlags = SCH_USE_STRONG_CRYPTO;
+		if (!creds->acquire(SECPKG_CRED_INBOUND, schannelCred)) {
+			return nullptr;
+		}
+		return creds;
+	}
+
+	static std::unique_ptr<TlsCredentials> forClient() {
+		std::unique_ptr<TlsCredentials> creds(new TlsCredentials());
+		SCHANNEL_CRED schannelCred;
+		ZeroMemory(&schannelCred, sizeof(schannelCred));
+		schannelCred.dwVersion = SCHANNEL_CRED_VERSION;
+		schannelCred.grbitEnabledProtocols = SP_PROT_TLS1_2_CLIENT;
+		schannelCred.dwFlags = SCH_USE_STRONG_CRYPTO | SCH_CRED_AUTO_CRED_VALIDATION | SCH_CRED_NO_DEFAULT_CREDS;
+		if (!creds->acquire(SECPKG_CRED_OUTBOUND, schannelCred)) {
+			return nullptr;
+		}
+		return creds;
+	}
+
+	CredHandle* handle() { return &m_credentials; }
+
+private:
+	TlsCredentials() : m_hasCredentials(false), m_store(nullptr), m_certificate(nullptr) {}
+
+	bool acquire(unsigned long direction, SCHANNEL_CRED& schannelCred) {
+		SECURITY_STATUS status = AcquireCredentialsHandleA(nullptr, const_cast<char*>(UNISP_NAME_A), direction,
+			nullptr, &schannelCred, nullptr, nullptr, &m_credentials, nullptr);
+		m_hasCredentials = status == SEC_E_OK;
+		return m_hasCredentials;
+	}
+
+	CredHandle m_credentials;
+	bool m_hasCredentials;
+	HCERTSTORE m_store;
+	PCCERT_CONTEXT m_certificate;
+};
+
+/*
+ * A connection that is either plain TCP or TLS over Schannel.
+ *
+ * Until accept() or connect() has succeeded the channel passes everything straight through to the socket,
+ * so callers use the same send()/recv() whether TLS is turned on or not. Once the handshake is done every
+ * record is encrypted in place in a single buffer. sendStream() reads file data straight into the data
+ * section of that buffer, so file contents are copied once from the file and then encrypted where they are.
+ */
+class TlsChannel
+{
+public:
+	explicit TlsChannel(SOCKET sock)
+		: m_sock(sock), m_credentials(nullptr), m_hasContext(false), m_isServer(false), m_encrypted(false), m_closeNotified(false), m_recvTimeLimit(0) {
+		ZeroMemory(&m_sizes, sizeof(m_sizes));
+	}
+
+	~TlsChannel() {
+		if (m_hasContext) {
+			DeleteSecurityContext(&m_context);
+		}
+	}
+
+	TlsChannel(const TlsChannel&) = delete;
+	TlsChannel& operator=(const TlsChannel&) = delete;
+
+	bool isEncrypted() const { return m_encrypted; }
+
+	// Whether recv() has received data to hand out, or a whole record to decrypt, without reading the socket first.
+	// Polling the socket can't tell, since those bytes have already left it. The rest of a partial record is still
+	// to come through the socket, so that doesn't count.
+	bool hasBuffered() const {
+		if (!m_plain.empty()) {
+			return true;
+		}
+		// A record is a 5 byte header, with the length of what follows in its last two bytes
+		if (m_incoming.size() < 5) {
+			return false;
+		}
+		size_t recordLength = (static_cast<unsigned char>(m_incoming[3]) << 8) | static_cast<unsigned char>(m_incoming[4]);
+		return m_incoming.size() >= 5 + recordLength;
+	}
+
+	// Give every recv() at most ms in total, 0 for no limit. The socket's receive timeout only bounds each read
+	// from the socket, and a record trickled in a few bytes at a time takes one read per piece.
+	void setRecvTimeLimit(DWORD ms) {
+		m_recvTimeLimit = ms;
+		setsockopt(m_sock, SOL_SOCKET, SO_RCVTIMEO, (const char*)&ms, sizeof(ms));
+	}
+
+	// Server side of the handshake
+	bool accept(TlsCredentials& creds) {
+		return handshake(creds, nullptr);
+	}
+
+	// Client side of the handshake. host has to match the name on the server's certificate.
+	bool connect(TlsCredentials& creds, const std::string& host) {
+		return handshake(creds, &host);
+	}
+
+	bool send(const char* data, size_t length) {
+		if (!m_encrypted) {
+			return sendAll(m_sock, data, length);
+		}
+		while (length > 0) {
+			size_t chunk = length < m_sizes.cbMaximumMessage ? length : m_sizes.cbMaximumMessage;
+			memcpy(m_record.data() + m_sizes.cbHeader, data, chunk);
+			if (!sendRecord(chunk)) {
+				return false;
+			}
+			data += chunk;
+			length -= chunk;
+		}
+		return true;
+	}
+
+	bool send(const std::string& data) {
+		return send(data.data(), data.size());
+	}
+
+	// Send everything left in the stream, or at most maxBytes of it.
+	// With hash set, every chunk is added to hash while it's in the send buffer, so the file is still only copied
+	// once. With digest set too, the stream has to have all maxBytes left, and the last chunk is only sent if the
+	// hash comes out as digest. Otherwise it's held back and this returns false.
+	bool sendStream(std::istream& in, unsigned long long maxBytes = ULLONG_MAX, Sha256* hash = nullptr, const std::string* digest = nullptr) {
+		std::vector<char> plainBuf;
+		if (!m_encrypted) {
+			plainBuf.resize(64 * 1024);
+		}
+		char* chunk = m_encrypted ? m_record.data() + m_sizes.cbHeader : plainBuf.data();
+		size_t chunkSize = m_encrypted ? m_sizes.cbMaximumMessage : plainBuf.size();
+
+		while (maxBytes > 0) {
+			in.read(chunk, maxBytes < chunkSize ? static_cast<std::streamsize>(maxBytes) : chunkSize);
+			size_t count = static_cast<size_t>(in.gcount());
+			if (count == 0) {
+				return digest == nullptr;
+			}
+			maxBytes -= count;
+			if (hash != nullptr) {
+				hash->update(chunk, count);
+			}
+			if (digest != nullptr && maxBytes == 0 && hash->hexDigest() != *digest) {
+				return false;
+			}
+			bool sent = m_encrypted ? sendRecord(count) : sendAll(m_sock, chunk, count);
+			if (!sent) {
+				return false;
+			}
+		}
+		return true;
+	}
+
+	// Same contract as ::recv(): the number of bytes received, 0 once the peer has closed, or SOCKET_ERROR.
+	// Over TLS, 0 means the peer sent close_notify. Closing the connection without it is SOCKET_ERROR.
+	int recv(char* buf, int length) {
+		if (!m_encrypted) {
+			return ::recv(m_sock, buf, length, 0);
+		}
+
+		ULONGLONG deadline = m_recvTimeLimit == 0 ? 0 : GetTickCount64() + m_recvTimeLimit;
+		while (m_plain.empty()) {
+			if (m_closeNotified) {
+				return 0;
+			}
+			if (!m_incoming.empty()) {
+				SecBuffer buffers[4];
+				buffers[0] = { static_cast<unsigned long>(m_incoming.size()), SECBUFFER_DATA, m_incoming.data() };
+				buffers[1] = { 0, SECBUFFER_EMPTY, nullptr };
+				buffers[2] = { 0, SECBUFFER_EMPTY, nullptr };
+				buffers[3] = { 0, SECBUFFER_EMPTY, nullptr };
+				SecBufferDesc desc = { SECBUFFER_VERSION, 4, buffers };
+
+				SECURITY_STATUS status = DecryptMessage(&m_context, &desc, 0, nullptr);
+				if (status == SEC_I_CONTEXT_EXPIRED) {
+					// The peer sent close_notify
+					m_closeNotified = true;
+					return 0;
+				}
+				if (status == SEC_E_OK) {
+					std::vector<char> extra;
+					for (SecBuffer& buffer : buffers) {
+						if (buffer.BufferType == SECBUFFER_DATA) {
+							m_plain.append(static_cast<char*>(buffer.pvBuffer), buffer.cbBuffer);
+						}
+						else if (buffer.BufferType == SECBUFFER_EXTRA) {
+							extra.assign(m_incoming.end() - buffer.cbBuffer, m_incoming.end());
+						}
+					}
+					m_incoming.swap(extra);
+					continue;
+				}
+				if (status != SEC_E_INCOMPLETE_MESSAGE) {
+					// Renegotiation isn't supported, and anything else is a broken or tampered record
+					return SOCKET_ERROR;
+				}
+			}
+
+			// The connection closing without close_notify may be a truncation attack, so it's an error
+			// rather than the end of the data
+			if (!receiveMore(deadline)) {
+				return SOCKET_ERROR;
+			}
+		}
+
+		int count = length < static_cast<int>(m_plain.size()) ? length : static_cast<int>(m_plain.size());
+		memcpy(buf, m_plain.data(), count);
+		m_plain.erase(0, count);
+		return count;
+	}
+
+	// Send close_notify so the peer can tell the end of the data from a truncation attack
+	void shutdown() {
+		if (!m_encrypted) {
+			return;
+		}
+		m_encrypted = false;
+
+		DWORD type = SCHANNEL_SHUTDOWN;
+		SecBuffer controlBuffer = { sizeof(type), SECBUFFER_TOKEN, &type };
+		SecBufferDesc controlDesc = { SECBUFFER_VERSION, 1, &controlBuffer };
+		if (ApplyControlToken(&m_context, &controlDesc) != SEC_E_OK) {
+			return;
+		}
+
+		SecBuffer outBuffer = { 0, SECBUFFER_TOKEN, nullptr };
+		SecBufferDesc outDesc = { SECBUFFER_VERSION, 1, &outBuffer };
+		DWORD outFlags = 0;
+		if (m_isServer) {
+			AcceptSecurityContext(m_credentials, &m_context, nullptr, ASC_FLAGS, 0, nullptr, &outDesc, &outFlags, nullptr);
+		}
+		else {
+			InitializeSecurityContextA(m_credentials, &m_context, nullptr, ISC_FLAGS, 0, 0, nullptr, 0, nullptr, &outDesc, &outFlags, nullptr);
+		}
+		if (outBuffer.pvBuffer != nullptr) {
+			sendAll(m_sock, static_cast<char*>(outBuffer.pvBuffer), outBuffer.cbBuffer);
+			FreeContextBuffer(outBuffer.pvBuffer);
+		}
+	}
+
+private:
+	static constexpr unsigned long ASC_FLAGS = ASC_REQ_SEQUENCE_DETECT | ASC_REQ_REPLAY_DETECT | ASC_REQ_CONFIDENTIALITY |
+		ASC_REQ_EXTENDED_ERROR | ASC_REQ_ALLOCATE_MEMORY | ASC_REQ_STREAM;
+	static constexpr unsigned long ISC_FLAGS = ISC_REQ_SEQUENCE_DETECT | ISC_REQ_REPLAY_DETECT | ISC_REQ_CONFIDENTIALITY |
+		ISC_REQ_EXTENDED_ERROR | ISC_REQ_ALLOCATE_MEMORY | ISC_REQ_STREAM;
+
+	// A peer that hasn't finished the handshake after this long in total gives up its thread,
+	// however slowly it trickles its messages in
+	static constexpr DWORD HANDSHAKE_TIMEOUT_MS = 5000;
+
+	// Run the handshake to completion, or until HANDSHAKE_TIMEOUT_MS is up. host is nullptr on the server side.
+	bool handshake(TlsCredentials& creds, const std::string* host) {
+		// receiveMore() shortens the socket's receive timeout as the deadline gets closer, so put it back afterwards
+		DWORD previousTimeout = 0;
+		int optionSize = sizeof(previousTimeout);
+		getsockopt(m_sock, SOL_SOCKET, SO_RCVTIMEO, (char*)&previousTimeout, &optionSize);
+		bool done = runHandshake(creds, host, GetTickCount64() + HANDSHAKE_TIMEOUT_MS);
+		setsockopt(m_sock, SOL_SOCKET, SO_RCVTIMEO, (const char*)&previousTimeout, sizeof(previousTimeout));
+		return done;
+	}
+
+	bool runHandshake(TlsCredentials& creds, const std::string* host, ULONGLONG deadline) {
+		m_credentials = creds.handle();
+		m_isServer = host == nullptr;
+		// The client speaks first
+		bool needInput = m_isServer;
+
+		while (true) {
+			if (needInput && !receiveMore(deadline)) {
+				return false;
+			}
+
+			SecBuffer inBuffers[2];
+			inBuffers[0] = { static_cast<unsigned long>(m_incoming.size()), SECBUFFER_TOKEN, m_incoming.data() };
+			inBuffers[1] = { 0, SECBUFFER_EMPTY, nullptr };
+			SecBufferDesc inDesc = { SECBUFFER_VERSION, 2, inBuffers };
+			SecBuffer outBuffer = { 0, SECBUFFER_TOKEN, nullptr };
+			SecBufferDesc outDesc = { SECBUFFER_VERSION, 1, &outBuffer };
+			DWORD outFlags = 0;
+
+			SECURITY_STATUS status;
+			if (m_isServer) {
+				status = AcceptSecurityContext(m_credentials, m_hasContext ? &m_context : nullptr, &inDesc, ASC_FLAGS, 0,
+					m_hasContext ? nullptr : &m_context, &outDesc, &outFlags, nullptr);
+			}
+			else {
+				status = InitializeSecurityContextA(m_credentials, m_hasContext ? &m_context : nullptr, const_cast<char*>(host->c_str()),
+					ISC_FLAGS, 0, 0, m_hasContext ? &inDesc : nullptr, 0, m_hasContext ? nullptr : &m_context, &outDesc, &outFlags, nullptr);
+			}
+
+			if (status == SEC_E_INCOMPLETE_MESSAGE) {
+				needInput = true;
+				continue;
+			}
+			if (status == SEC_E_OK || status == SEC_I_CONTINUE_NEEDED) {
+				m_hasContext = true;
+			}
+			if (outBuffer.pvBuffer != nullptr) {
+				bool sent = outBuffer.cbBuffer == 0 || sendAll(m_sock, static_cast<char*>(outBuffer.pvBuffer), outBuffer.cbBuffer);
+				FreeContextBuffer(outBuffer.pvBuffer);
+				if (!sent) {
+					return false;
+				}
+			}
+			if (status != SEC_E_OK && status != SEC_I_CONTINUE_NEEDED) {
+				return false;
+			}
+
+			// Whatever the call didn't consume belongs to the next handshake message, or to the first record
+			if (inBuffers[1].BufferType == SECBUFFER_EXTRA) {
+				m_incoming.erase(m_incoming.begin(), m_incoming.end() - inBuffers[1].cbBuffer);
+			}
+			else {
+				m_incoming.clear();
+			}
+
+			if (status == SEC_E_OK) {
+				break;
+			}
+			needInput = m_incoming.empty();
+		}
+
+		if (QueryContextAttributesA(&m_context, SECPKG_ATTR_STREAM_SIZES, &m_sizes) != SEC_E_OK) {
+			return false;
+		}
+		m_record.resize(m_sizes.cbHeader + m_sizes.cbMaximumMessage + m_sizes.cbTrailer);
+		m_encrypted = true;
+		return true;
+	}
+
+	// Encrypt the length bytes that are already in the data section of m_record, in place, and send the record
+	bool sendRecord(size_t length) {
+		SecBuffer buffers[4];
+		buffers[0] = { m_sizes.cbHeader, SECBUFFER_STREAM_HEADER, m_record.data() };
+		buffers[1] = { static_cast<unsigned long>(length), SECBUFFER_DATA, m_record.data() + m_sizes.cbHeader };
+		buffers[2] = { m_sizes.cbTrailer, SECBUFFER_STREAM_TRAILER, m_record.data() + m_sizes.cbHeader + length };
+		buffers[3] = { 0, SECBUFFER_EMPTY, nullptr };
+		SecBufferDesc desc = { SECBUFFER_VERSION, 4, buffers };
+		if (EncryptMessage(&m_context, 0, &desc, 0) != SEC_E_OK) {
+			return false;
+		}
+		return sendAll(m_sock, m_record.data(), buffers[0].cbBuffer + buffers[1].cbBuffer + buffers[2].cbBuffer);
+	}
+
+	// Append whatever the socket has to m_incoming. Returns false on error, once the peer has closed, or if nothing
+	// arrives before deadline, a GetTickCount64() time, or 0 to wait as long as the socket's receive timeout allows.
+	bool receiveMore(ULONGLONG deadline) {
+		if (deadline != 0) {
+			ULONGLONG now = GetTickCount64();
+			if (now >= deadline) {
+				return false;
+			}
+			DWORD left = static_cast<DWORD>(deadline - now);
+			setsockopt(m_sock, SOL_SOCKET, SO_RCVTIMEO, (const char*)&left, sizeof(left));
+		}
+		const int BUFSIZE = 16 * 1024 + 512;
+		char buf[BUFSIZE];
+		int byteCount = ::recv(m_sock, buf, BUFSIZE, 0);
+		if (byteCount <= 0) {
+			return false;
+		}
+		m_incoming.insert(m_incoming.end(), buf, buf + byteCount);
+		return true;
+	}
+
+	SOCKET m_sock;
+	CredHandle* m_credentials;
+	CtxtHandle m_context;
+	bool m_hasContext;
+	bool m_isServer;
+	bool m_encrypted;
+	// the peer has sent close_notify, so there's nothing more to receive
+	bool m_closeNotified;
+	// longest a single recv() may take, 0 for no limit
+	DWORD m_recvTimeLimit;
+	SecPkgContext_StreamSizes m_sizes;
+	// header + data + trailer of the record currently being encrypted
+	std::vector<char> m_record;
+	// encrypted bytes received but not decrypted yet
+	std::vector<char> m_incoming;
+	// decrypted bytes not handed to the caller yet
+	std::string m_plain;
+};